@@ -61,6 +61,10 @@ int main(int argc, char** argv) {
   default:                     printf("DEVICE=%d\n", DEVICE); break;
   }
 
+  if (argc > 1 && std::string(argv[1]) == "--autotune") {
+    matrix::op::autotune(1024);
+  }
+
   //runMatrixVectorMul();
   //runMatrixMatrixMul();
   benchmark(10);
@@ -44,69 +44,685 @@
 
 // It turns out that the compiler generates much better code if
 // we "hardwire" this block size.  16 works well for an NVIDIA 
-// GPU, 32 works well for a CPU
+// GPU, 32 works well for a CPU.  The host picks one for the
+// device at hand and passes it in with -Dblksz=N.
+#ifndef blksz
 #define blksz 16
+#endif
 
-__kernel void mmul(
-                const unsigned int             N,
+// Unroll factor of the loops over kloc; the autotuner varies it
+// with -Dkunroll=N, the default unrolls them completely
+#ifndef kunroll
+#define kunroll blksz
+#endif
+
+#define PRAGMA(x) _Pragma(#x)
+#define UNROLL(n) PRAGMA(unroll n)
+
+// Vector width of the global loads and stores in mmul_vec: 1, 2,
+// 4 or 8, set with -Dvw=N.  It must divide blksz.
+#ifndef vw
+#define vw 4
+#endif
+
+#define CAT_(a, b) a##b
+#define CAT(a, b) CAT_(a, b)
+
+#if vw == 1
+#define floatv float
+#define vloadv(offset, p) ((p)[offset])
+#define vstorev(value, offset, p) ((p)[offset] = (value))
+#else
+#define floatv CAT(float, vw)
+#define vloadv CAT(vload, vw)
+#define vstorev CAT(vstore, vw)
+#endif
+
+// Operands stored transposed, set with -Dtrans_a=1 and -Dtrans_b=1.
+// A and B then hold A^T and B^T, with lda and ldb the row pitches
+// of what is stored.  The tile loads of mmul and mmul_reg read
+// along the stored rows, so they stay coalesced, and transpose the
+// tile on its way into local memory.  mmul_vec does not support
+// transposed operands.
+#ifndef trans_a
+#define trans_a 0
+#endif
+
+#ifndef trans_b
+#define trans_b 0
+#endif
+
+// Optional epilogue fused into the store of C, compiled in with
+//    -Depilogue_bias=N   0: none, 1: one bias per row of C,
+//                        2: one bias per column of C
+//    -Depilogue_act=N    0: none, 1: ReLU, 2: GELU (tanh form),
+//                        3: sigmoid, 4: clamp to [lo, hi]
+// Kernels built with either take four more arguments after Bwrk
+// (bias, scale, lo and hi) and store
+//    scale * act(alpha*A*B + beta*C + bias)
+// Without them the kernels are exactly the plain ones.
+#if defined(epilogue_bias) || defined(epilogue_act)
+#define epilogue
+#endif
+
+#ifndef epilogue_bias
+#define epilogue_bias 0
+#endif
+
+#ifndef epilogue_act
+#define epilogue_act 0
+#endif
+
+#ifdef epilogue
+#define EPILOGUE_ARGS , __global const float* restrict bias, \
+                        const float scale, const float lo, const float hi
+#define EPILOGUE_PASS , bias, scale, lo, hi
+#else
+#define EPILOGUE_ARGS
+#define EPILOGUE_PASS
+#endif
+
+// Works on scalars and vectors alike
+#if epilogue_act == 1
+#define ACTIVATE(x) fmax((x), 0.0f)
+#elif epilogue_act == 2
+#define ACTIVATE(x) (0.5f*(x)*(1.0f + tanh(0.7978845608f*((x) + 0.044715f*(x)*(x)*(x)))))
+#elif epilogue_act == 3
+#define ACTIVATE(x) (1.0f/(1.0f + exp(-(x))))
+#elif epilogue_act == 4
+#define ACTIVATE(x) clamp((x), lo, hi)
+#else
+#define ACTIVATE(x) (x)
+#endif
+
+// All kernels compute C = alpha*A*B + beta*C, followed by the
+// epilogue if there is one.  C is only read when beta is non-zero,
+// so for a plain product it may start out uninitialised.  row and
+// col locate c in C for the bias.
+void update_c(__global float* restrict c, const int row, const int col,
+              const float value, const float alpha, const float beta
+              EPILOGUE_ARGS)
+{
+    float result = alpha*value;
+    if (beta != 0.0f)
+       result += beta*(*c);
+
+#ifdef epilogue
+#if epilogue_bias == 1
+    result += bias[row];
+#elif epilogue_bias == 2
+    result += bias[col];
+#endif
+    result = scale*ACTIVATE(result);
+#endif
+
+    *c = result;
+}
+
+// Body of mmul, shared with mmul_batched
+void mmul_block(
+                const int                      M,
+                const int                      N,
+                const int                      K,
+                const float                    alpha,
                 __global const float* restrict A,
+                const int                      lda,
                 __global const float* restrict B,
+                const int                      ldb,
+                const float                    beta,
                 __global       float* restrict C,
+                const int                      ldc,
                 __local        float* restrict Awrk,
-                __local        float* restrict Bwrk)
+                __local        float* restrict Bwrk
+                EPILOGUE_ARGS)
 {
     int kloc, Kblk;
     float Ctmp=0.0f;
 
-    //  This work-item will compute element C(i,j)
+    // A is M x K, B is K x N and C is M x N, all row-major with
+    // rows lda, ldb and ldc elements apart.  The NDRange is
+    // rounded up to whole blocks, so the blocks along the right
+    // and bottom edges of C may be partial.
+
+    //  This work-item will compute element C(i,j), which sits
+    //  in row j and column i of C
     const int i = get_global_id(0);
     const int j = get_global_id(1);
 
-    // Element C(i,j) is in block C(Iblk,Jblk)
-    const int Iblk = get_group_id(0);
-    const int Jblk = get_group_id(1);
-
     // C(i,j) is element C(iloc, jloc) of block C(Iblk, Jblk)
     const int iloc = get_local_id(0);
     const int jloc = get_local_id(1);
 
-    // The number of blocks are the same in each dimension
-    const int Num_BLK = N/blksz;
-
-    // Setup the upper-left-corner (base address) for the A and
-    // B blocks plus the increments to advance base addresses as
-    // we loop over blocks
-          int Abase = Iblk*N*blksz;    
-    const int Ainc  = blksz;
-
-          int Bbase = Jblk*blksz;
-    const int Binc  = blksz*N;
+    // The number of blocks along K, counting a partial last block
+    const int Num_BLK = (K+blksz-1)/blksz;
 
-
-    // C(Iblk,Jblk) = (sum over Kblk) A(Iblk,Kblk)*B(Kblk,Jblk)
+    // C(Iblk,Jblk) = (sum over Kblk) A(Jblk,Kblk)*B(Kblk,Iblk)
     for (Kblk = 0;  Kblk<Num_BLK;  Kblk++)
     {
-       // Load A(Iblk,Kblk) and B(Kblk,Jblk) into local memory.
+       // Load A(Jblk,Kblk) and B(Kblk,Iblk) into local memory.
        // Each work-item loads a single element of the two blocks
-       // which are shared with the entire work-group.
+       // which are shared with the entire work-group.  Elements
+       // outside A or B are stored as zero so that partial
+       // blocks add nothing to the dot products.
+       const int kbase = Kblk*blksz;
+
+#if trans_a
+       // Work-item (iloc, jloc) loads A(row+iloc, kbase+jloc)
+       const int arow = get_group_id(1)*blksz+iloc;
+       Awrk[iloc*blksz+jloc] = (arow < M && kbase+jloc < K) ?
+          A[(kbase+jloc)*lda+arow] : 0.0f;
+#else
+       Awrk[jloc*blksz+iloc] = (j < M && kbase+iloc < K) ?
+          A[j*lda+kbase+iloc] : 0.0f;
+#endif
 
-       Awrk[jloc*blksz+iloc] = A[Abase+jloc*N+iloc];
-       Bwrk[jloc*blksz+iloc] = B[Bbase+jloc*N+iloc];
+#if trans_b
+       // Work-item (iloc, jloc) loads B(kbase+iloc, col+jloc)
+       const int bcol = get_group_id(0)*blksz+jloc;
+       Bwrk[iloc*blksz+jloc] = (kbase+iloc < K && bcol < N) ?
+          B[bcol*ldb+kbase+iloc] : 0.0f;
+#else
+       Bwrk[jloc*blksz+iloc] = (kbase+jloc < K && i < N) ?
+          B[(kbase+jloc)*ldb+i] : 0.0f;
+#endif
 
        barrier(CLK_LOCAL_MEM_FENCE);
 
        // Compute dot products over local blocks to find
        // the contribution to C(i,j) from this block
-       #pragma unroll
+       UNROLL(kunroll)
        for (kloc=0; kloc<blksz; kloc++)
           Ctmp += Awrk[jloc*blksz+kloc] * Bwrk[kloc*blksz+iloc];
 
        barrier(CLK_LOCAL_MEM_FENCE);
-       Abase += Ainc;
-       Bbase += Binc;
     }
  
     // update global C matrix 
-    C[j*N+i] = Ctmp;
+    if (j < M && i < N)
+       update_c(C+j*ldc+i, j, i, Ctmp, alpha, beta EPILOGUE_PASS);
 
 }
+
+__kernel void mmul(
+                const int                      M,
+                const int                      N,
+                const int                      K,
+                const float                    alpha,
+                __global const float* restrict A,
+                const int                      lda,
+                __global const float* restrict B,
+                const int                      ldb,
+                const float                    beta,
+                __global       float* restrict C,
+                const int                      ldc,
+                __local        float* restrict Awrk,
+                __local        float* restrict Bwrk
+                EPILOGUE_ARGS)
+{
+    mmul_block(M, N, K, alpha, A, lda, B, ldb, beta, C, ldc, Awrk, Bwrk
+               EPILOGUE_PASS);
+}
+
+// Multiplies a batch of same-shape matrices in one launch.  The
+// matrices of each operand are stored one after another, strideA,
+// strideB and strideC elements apart, and the third dimension of
+// the NDRange selects the matrix of the batch.
+__kernel void mmul_batched(
+                const int                      M,
+                const int                      N,
+                const int                      K,
+                const float                    alpha,
+                __global const float* restrict A,
+                const int                      lda,
+                const int                      strideA,
+                __global const float* restrict B,
+                const int                      ldb,
+                const int                      strideB,
+                const float                    beta,
+                __global       float* restrict C,
+                const int                      ldc,
+                const int                      strideC,
+                __local        float* restrict Awrk,
+                __local        float* restrict Bwrk
+                EPILOGUE_ARGS)
+{
+    const int batch = get_global_id(2);
+
+    mmul_block(M, N, K, alpha,
+               A+batch*strideA, lda,
+               B+batch*strideB, ldb, beta,
+               C+batch*strideC, ldc,
+               Awrk, Bwrk EPILOGUE_PASS);
+}
+
+// C = alpha*A*B + beta*C for a block-sparse A, stored as its nonzero
+// blksz x blksz blocks (see BsrMatrix in matrix.hpp).  The blocks of
+// block row Jblk are numbers blockRowPtr[Jblk] to blockRowPtr[Jblk+1]-1
+// of blocks, each one row-major and zero-padded past the edges of A,
+// and block n sits in block column blockCol[n].  The Kblk loop of
+// mmul_block runs over this list instead of every block of the row,
+// so blocks that are all zero are never loaded or multiplied and the
+// work grows with the number of blocks kept.  The NDRange is as for
+// mmul.
+__kernel void mmul_bsr(
+                const int                      M,
+                const int                      N,
+                const int                      K,
+                const float                    alpha,
+                __global const int*   restrict blockRowPtr,
+                __global const int*   restrict blockCol,
+                __global const float* restrict blocks,
+                __global const float* restrict B,
+                const int                      ldb,
+                const float                    beta,
+                __global       float* restrict C,
+                const int                      ldc,
+                __local        float* restrict Awrk,
+                __local        float* restrict Bwrk
+                EPILOGUE_ARGS)
+{
+    int kloc, blk;
+    float Ctmp=0.0f;
+
+    const int i = get_global_id(0);
+    const int j = get_global_id(1);
+    const int iloc = get_local_id(0);
+    const int jloc = get_local_id(1);
+    const int Jblk = get_group_id(1);
+
+    for (blk = blockRowPtr[Jblk];  blk<blockRowPtr[Jblk+1];  blk++)
+    {
+       // Blocks of A are stored whole, so only B needs bounds checks
+       const int kbase = blockCol[blk]*blksz;
+
+       Awrk[jloc*blksz+iloc] = blocks[blk*blksz*blksz+jloc*blksz+iloc];
+       Bwrk[jloc*blksz+iloc] = (kbase+jloc < K && i < N) ?
+          B[(kbase+jloc)*ldb+i] : 0.0f;
+
+       barrier(CLK_LOCAL_MEM_FENCE);
+
+       UNROLL(kunroll)
+       for (kloc=0; kloc<blksz; kloc++)
+          Ctmp += Awrk[jloc*blksz+kloc] * Bwrk[kloc*blksz+iloc];
+
+       barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (j < M && i < N)
+       update_c(C+j*ldc+i, j, i, Ctmp, alpha, beta EPILOGUE_PASS);
+}
+
+// Work per thread of the register-tiled kernel: every work-item
+// accumulates a wpt x wpt micro-tile of C in private memory, so a
+// blksz x blksz work-group covers a tilesz x tilesz tile of C and
+// each value read from local memory is reused wpt times.  It
+// takes the same arguments as mmul but expects M and N to be
+// multiples of tilesz and K a multiple of blksz.
+#ifndef wpt
+#define wpt 4
+#endif
+#define tilesz (blksz*wpt)
+
+__kernel void mmul_reg(
+                const int                      M,
+                const int                      N,
+                const int                      K,
+                const float                    alpha,
+                __global const float* restrict A,
+                const int                      lda,
+                __global const float* restrict B,
+                const int                      ldb,
+                const float                    beta,
+                __global       float* restrict C,
+                const int                      ldc,
+                __local        float* restrict Awrk,
+                __local        float* restrict Bwrk
+                EPILOGUE_ARGS)
+{
+    int kloc, Kblk, wi, wj;
+    float Creg[wpt][wpt];
+    float Breg[wpt];
+
+    // This work-item computes the elements C(i+wi*blksz, j+wj*blksz)
+    // for 0 <= wi,wj < wpt, where i and j index the first element of
+    // its micro-tile.  Striding by blksz keeps loads and stores of
+    // neighbouring work-items contiguous.
+    const int iloc = get_local_id(0);
+    const int jloc = get_local_id(1);
+
+    // Upper-left corner of the C tile owned by this work-group
+    const int ibase = get_group_id(0)*tilesz;
+    const int jbase = get_group_id(1)*tilesz;
+
+    const int Num_BLK = K/blksz;
+
+    for (wj=0; wj<wpt; wj++)
+       for (wi=0; wi<wpt; wi++)
+          Creg[wj][wi] = 0.0f;
+
+    for (Kblk = 0;  Kblk<Num_BLK;  Kblk++)
+    {
+       // Load the tilesz x blksz panel of A and the blksz x tilesz
+       // panel of B into local memory.  Each work-item loads wpt
+       // elements of each panel.
+       const int kbase = Kblk*blksz;
+
+       for (wi=0; wi<wpt; wi++) {
+#if trans_a
+          Awrk[(iloc+wi*blksz)*blksz+jloc] =
+             A[(kbase+jloc)*lda+jbase+iloc+wi*blksz];
+#else
+          Awrk[(jloc+wi*blksz)*blksz+iloc] =
+             A[(jbase+jloc+wi*blksz)*lda+kbase+iloc];
+#endif
+#if trans_b
+          Bwrk[iloc*tilesz+jloc+wi*blksz] =
+             B[(ibase+jloc+wi*blksz)*ldb+kbase+iloc];
+#else
+          Bwrk[jloc*tilesz+iloc+wi*blksz] =
+             B[(kbase+jloc)*ldb+ibase+iloc+wi*blksz];
+#endif
+       }
+
+       barrier(CLK_LOCAL_MEM_FENCE);
+
+       // Rank-1 updates of the micro-tile, one per column of the
+       // A panel, with the row of B cached in registers
+       UNROLL(kunroll)
+       for (kloc=0; kloc<blksz; kloc++) {
+          #pragma unroll
+          for (wi=0; wi<wpt; wi++)
+             Breg[wi] = Bwrk[kloc*tilesz+iloc+wi*blksz];
+
+          #pragma unroll
+          for (wj=0; wj<wpt; wj++) {
+             const float Aval = Awrk[(jloc+wj*blksz)*blksz+kloc];
+             #pragma unroll
+             for (wi=0; wi<wpt; wi++)
+                Creg[wj][wi] += Aval * Breg[wi];
+          }
+       }
+
+       barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    // update global C matrix
+    for (wj=0; wj<wpt; wj++)
+       for (wi=0; wi<wpt; wi++)
+          update_c(C+(jbase+jloc+wj*blksz)*ldc+ibase+iloc+wi*blksz,
+                   jbase+jloc+wj*blksz, ibase+iloc+wi*blksz,
+                   Creg[wj][wi], alpha, beta EPILOGUE_PASS);
+}
+
+// Rows of the local blocks in mmul_vec are ldl floats apart.  The
+// padding puts the elements of a column of Awrk, which the rows
+// of a work-group read at the same time, into different banks.
+#define lpad 1
+#define ldl (blksz+lpad)
+
+// Blocked multiply like mmul, with each work-item computing vw
+// adjacent elements of a row of C so that it can move data between
+// global and local memory with vector loads and stores.  The
+// work-group is blksz/vw x blksz.  It takes the same arguments as
+// mmul but expects M, N and K to be multiples of blksz, and lda,
+// ldb and ldc to be multiples of vw.
+__kernel void mmul_vec(
+                const int                      M,
+                const int                      N,
+                const int                      K,
+                const float                    alpha,
+                __global const float* restrict A,
+                const int                      lda,
+                __global const float* restrict B,
+                const int                      ldb,
+                const float                    beta,
+                __global       float* restrict C,
+                const int                      ldc,
+                __local        float* restrict Awrk,
+                __local        float* restrict Bwrk
+                EPILOGUE_ARGS)
+{
+    int kloc, Kblk;
+    floatv Ctmp = (floatv)(0.0f);
+
+    // This work-item computes C(i..i+vw-1, j), which is
+    // C(iloc..iloc+vw-1, jloc) of its work-group's block
+    const int iloc = get_local_id(0)*vw;
+    const int jloc = get_local_id(1);
+    const int i = get_group_id(0)*blksz+iloc;
+    const int j = get_global_id(1);
+
+    const int Num_BLK = K/blksz;
+
+    for (Kblk = 0;  Kblk<Num_BLK;  Kblk++)
+    {
+       // Each work-item copies vw elements of a row of the A and
+       // B blocks into local memory
+       const int kbase = Kblk*blksz;
+
+       vstorev(vloadv(0, A+j*lda+kbase+iloc), 0, Awrk+jloc*ldl+iloc);
+       vstorev(vloadv(0, B+(kbase+jloc)*ldb+i), 0, Bwrk+jloc*ldl+iloc);
+
+       barrier(CLK_LOCAL_MEM_FENCE);
+
+       UNROLL(kunroll)
+       for (kloc=0; kloc<blksz; kloc++)
+          Ctmp += Awrk[jloc*ldl+kloc] * vloadv(0, Bwrk+kloc*ldl+iloc);
+
+       barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    // update global C matrix, as update_c does for one element
+    Ctmp *= alpha;
+    if (beta != 0.0f)
+       Ctmp += beta*vloadv(0, C+j*ldc+i);
+
+#ifdef epilogue
+#if epilogue_bias == 1
+    Ctmp += bias[j];
+#elif epilogue_bias == 2
+    Ctmp += vloadv(0, bias+i);
+#endif
+    Ctmp = scale*ACTIVATE(Ctmp);
+#endif
+
+    vstorev(Ctmp, 0, C+j*ldc+i);
+}
+
+// Blocked multiply like mmul for A and B stored as IEEE half
+// precision, which halves the bytes read from global memory.
+// vload_half widens each element to float as it is loaded, so the
+// blocks in local memory and the accumulation stay single precision
+// and the device does not need cl_khr_fp16.  C is single precision.
+__kernel void mmul_half(
+                const int                      M,
+                const int                      N,
+                const int                      K,
+                const float                    alpha,
+                __global const half*  restrict A,
+                const int                      lda,
+                __global const half*  restrict B,
+                const int                      ldb,
+                const float                    beta,
+                __global       float* restrict C,
+                const int                      ldc,
+                __local        float* restrict Awrk,
+                __local        float* restrict Bwrk
+                EPILOGUE_ARGS)
+{
+    int kloc, Kblk;
+    float Ctmp=0.0f;
+
+    const int i = get_global_id(0);
+    const int j = get_global_id(1);
+    const int iloc = get_local_id(0);
+    const int jloc = get_local_id(1);
+
+    const int Num_BLK = (K+blksz-1)/blksz;
+
+    for (Kblk = 0;  Kblk<Num_BLK;  Kblk++)
+    {
+       const int kbase = Kblk*blksz;
+
+       Awrk[jloc*blksz+iloc] = (j < M && kbase+iloc < K) ?
+          vload_half(j*lda+kbase+iloc, A) : 0.0f;
+       Bwrk[jloc*blksz+iloc] = (kbase+jloc < K && i < N) ?
+          vload_half((kbase+jloc)*ldb+i, B) : 0.0f;
+
+       barrier(CLK_LOCAL_MEM_FENCE);
+
+       UNROLL(kunroll)
+       for (kloc=0; kloc<blksz; kloc++)
+          Ctmp += Awrk[jloc*blksz+kloc] * Bwrk[kloc*blksz+iloc];
+
+       barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (j < M && i < N)
+       update_c(C+j*ldc+i, j, i, Ctmp, alpha, beta EPILOGUE_PASS);
+}
+
+// Blocked multiply like mmul for int8 operands quantized as
+//    A(r,k) = scaleA[r] * (Aq(r,k) - zeroA[r])    one pair per row
+//    B(k,c) = scaleB[c] * (Bq(k,c) - zeroB[c])    one pair per column
+// The zero points are removed as the blocks are loaded, the dot
+// products accumulate exactly in int32 and scaleA[r]*scaleB[c]
+// dequantizes each element of C as it is stored.
+__kernel void mmul_i8(
+                const int                      M,
+                const int                      N,
+                const int                      K,
+                const float                    alpha,
+                __global const char*  restrict A,
+                const int                      lda,
+                __global const float* restrict scaleA,
+                __global const int*   restrict zeroA,
+                __global const char*  restrict B,
+                const int                      ldb,
+                __global const float* restrict scaleB,
+                __global const int*   restrict zeroB,
+                const float                    beta,
+                __global       float* restrict C,
+                const int                      ldc,
+                __local        int*   restrict Awrk,
+                __local        int*   restrict Bwrk
+                EPILOGUE_ARGS)
+{
+    int kloc, Kblk;
+    int Ctmp=0;
+
+    const int i = get_global_id(0);
+    const int j = get_global_id(1);
+    const int iloc = get_local_id(0);
+    const int jloc = get_local_id(1);
+
+    const int Num_BLK = (K+blksz-1)/blksz;
+
+    for (Kblk = 0;  Kblk<Num_BLK;  Kblk++)
+    {
+       const int kbase = Kblk*blksz;
+
+       Awrk[jloc*blksz+iloc] = (j < M && kbase+iloc < K) ?
+          A[j*lda+kbase+iloc] - zeroA[j] : 0;
+       Bwrk[jloc*blksz+iloc] = (kbase+jloc < K && i < N) ?
+          B[(kbase+jloc)*ldb+i] - zeroB[i] : 0;
+
+       barrier(CLK_LOCAL_MEM_FENCE);
+
+       UNROLL(kunroll)
+       for (kloc=0; kloc<blksz; kloc++)
+          Ctmp += Awrk[jloc*blksz+kloc] * Bwrk[kloc*blksz+iloc];
+
+       barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (j < M && i < N)
+       update_c(C+j*ldc+i, j, i, scaleA[j]*scaleB[i]*Ctmp, alpha, beta
+                EPILOGUE_PASS);
+}
+
+// C = alpha*A + beta*B over an M x N block of each operand.  The
+// blocks start offA, offB and offC elements into their buffers, so
+// that the quadrant sums of multiply_strassen read and write the
+// quadrants in place.  C may be the same buffer as A or B.
+__kernel void madd(
+                const int             M,
+                const int             N,
+                const float           alpha,
+                __global const float* A,
+                const int             offA,
+                const int             lda,
+                const float           beta,
+                __global const float* B,
+                const int             offB,
+                const int             ldb,
+                __global       float* C,
+                const int             offC,
+                const int             ldc)
+{
+    const int i = get_global_id(0);
+    const int j = get_global_id(1);
+
+    if (j < M && i < N)
+       C[offC+j*ldc+i] = alpha*A[offA+j*lda+i] + beta*B[offB+j*ldb+i];
+}
+
+// Double precision mmul, edge-checked like mmul.  It is only
+// compiled for devices that support cl_khr_fp64; the host checks
+// for the extension before it asks for this kernel.  There is no
+// epilogue: update_c works in single precision.
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+
+__kernel void mmul_f64(
+                const int                       M,
+                const int                       N,
+                const int                       K,
+                const double                    alpha,
+                __global const double* restrict A,
+                const int                       lda,
+                __global const double* restrict B,
+                const int                       ldb,
+                const double                    beta,
+                __global       double* restrict C,
+                const int                       ldc,
+                __local        double* restrict Awrk,
+                __local        double* restrict Bwrk)
+{
+    int kloc, Kblk;
+    double Ctmp=0.0;
+
+    const int i = get_global_id(0);
+    const int j = get_global_id(1);
+    const int iloc = get_local_id(0);
+    const int jloc = get_local_id(1);
+
+    const int Num_BLK = (K+blksz-1)/blksz;
+
+    for (Kblk = 0;  Kblk<Num_BLK;  Kblk++)
+    {
+       const int kbase = Kblk*blksz;
+
+       Awrk[jloc*blksz+iloc] = (j < M && kbase+iloc < K) ?
+          A[j*lda+kbase+iloc] : 0.0;
+       Bwrk[jloc*blksz+iloc] = (kbase+jloc < K && i < N) ?
+          B[(kbase+jloc)*ldb+i] : 0.0;
+
+       barrier(CLK_LOCAL_MEM_FENCE);
+
+       UNROLL(kunroll)
+       for (kloc=0; kloc<blksz; kloc++)
+          Ctmp += Awrk[jloc*blksz+kloc] * Bwrk[kloc*blksz+iloc];
+
+       barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (j < M && i < N)
+    {
+       double result = alpha*Ctmp;
+       if (beta != 0.0)
+          result += beta*C[j*ldc+i];
+       C[j*ldc+i] = result;
+    }
+}
+#endif
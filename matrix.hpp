@@ -3,20 +3,37 @@
 
 #define __CL_ENABLE_EXCEPTIONS
 #include "cl.hpp"
+#include "util.hpp"
+#include "tuning.hpp"
 
-#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <functional>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace matrix {
   typedef unsigned int dim_t;
 
-  template <const dim_t W, const dim_t H>
+  // A W x H row-major matrix of elements of type T
+  template <const dim_t W, const dim_t H, typename T = float>
   class Matrix {
   public:
     Matrix() {
       static_assert(W > 0, "width must be > 0");
       static_assert(H > 0, "height must be > 0");
-      matrix = new float[W*H];
+      matrix = new T[W*H];
     }
 
     virtual ~Matrix() {
@@ -41,13 +58,17 @@ namespace matrix {
 
     cl::Buffer createBuffer(cl::Context& context, const cl_mem_flags flags) const {
       if (flags != CL_MEM_WRITE_ONLY) {
-        return cl::Buffer(context, flags, this->size() * sizeof(float), matrix);
+        return cl::Buffer(context, flags, this->size() * sizeof(T), matrix);
       } else {
-        return cl::Buffer(context, flags, this->size() * sizeof(float));
+        return cl::Buffer(context, flags, this->size() * sizeof(T));
       }
     }
 
-    float* get() {
+    T* get() {
+      return matrix;
+    }
+
+    const T* get() const {
       return matrix;
     }
 
@@ -74,145 +95,2464 @@ namespace matrix {
     }
 
   private:
-    float *matrix;
+    T *matrix;
   };
 
-  template <const dim_t W, const dim_t H>
-  inline Matrix<W, H> randmat() {
-    Matrix<W, H> m;
+  template <const dim_t W, const dim_t H, typename T = float>
+  inline Matrix<W, H, T> randmat() {
+    Matrix<W, H, T> m;
+    T* const __restrict__ p = m.get();
+    auto gen = std::bind(std::uniform_real_distribution<T>(0, 1), std::default_random_engine());
+
+    for (auto i = 0; i < m.size(); ++i) {
+      p[i] = gen();
+    }
+    return m;
+  }
+
+  template <const dim_t W, const dim_t H, typename T = float>
+  inline Matrix<W, H, T> zeromat() {
+    Matrix<W, H, T> m;
+    std::fill_n(m.get(), m.size(), 0);
+    return m;
+  }
+
+  template <const dim_t DIM, typename T = float>
+  inline Matrix<DIM, 1, T> randvec() {
+    return matrix::randmat<DIM, 1, T>();
+  }
+
+  template <const dim_t DIM, typename T = float>
+  inline Matrix<DIM, 1, T> zerovec() {
+    return matrix::zeromat<DIM, 1, T>();
+  }
+
+  // COUNT matrices of W x H stored one after another in a single
+  // allocation, so that a whole batch moves to the device as one buffer
+  template <const dim_t W, const dim_t H, const dim_t COUNT>
+  class MatrixBatch : public Matrix<W, H*COUNT> {
+  public:
+    using Matrix<W, H*COUNT>::get;
+
+    float* get(const dim_t index) {
+      return this->get() + index*stride();
+    }
+
+    dim_t count() const {
+      return COUNT;
+    }
+
+    dim_t stride() const {
+      return W*H;
+    }
+  };
+
+  template <const dim_t W, const dim_t H, const dim_t COUNT>
+  inline MatrixBatch<W, H, COUNT> randbatch() {
+    MatrixBatch<W, H, COUNT> m;
     float* const __restrict__ p = m.get();
     auto gen = std::bind(std::uniform_real_distribution<float>(0.0f, 1.0f), std::default_random_engine());
 
-    for (auto i = 0; i < m.size(); ++i) {
+    for (dim_t i = 0; i < m.size(); ++i) {
       p[i] = gen();
     }
     return m;
   }
 
-  template <const dim_t W, const dim_t H>
-  inline Matrix<W, H> zeromat() {
-    Matrix<W, H> m;
+  template <const dim_t W, const dim_t H, const dim_t COUNT>
+  inline MatrixBatch<W, H, COUNT> zerobatch() {
+    MatrixBatch<W, H, COUNT> m;
     std::fill_n(m.get(), m.size(), 0);
     return m;
   }
 
-  template <const dim_t DIM>
-  inline Matrix<DIM, 1> randvec() {
-    return matrix::randmat<DIM, 1>();
+  // IEEE 754 half precision conversions, rounding to nearest even
+  inline cl_half toHalf(const float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    const uint32_t sign = (bits >> 16) & 0x8000;
+    const int exponent = (bits >> 23) & 0xff;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    if (exponent == 0xff) {
+      return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    }
+    const int e = exponent - 127 + 15;
+    if (e >= 31) {
+      return sign | 0x7c00;
+    }
+    if (e <= 0) {
+      // Subnormal, or too small even for that
+      if (e < -10) {
+        return sign;
+      }
+      mantissa |= 0x800000;
+      const int shift = 14 - e;
+      uint32_t half = mantissa >> shift;
+      const uint32_t rest = mantissa & ((1u << shift) - 1);
+      const uint32_t halfway = 1u << (shift - 1);
+      if (rest > halfway || (rest == halfway && (half & 1))) {
+        ++half;
+      }
+      return sign | half;
+    }
+    // A carry out of the mantissa correctly rounds up to infinity
+    uint32_t half = (e << 10) | (mantissa >> 13);
+    const uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+      ++half;
+    }
+    return sign | half;
   }
 
-  template <const dim_t DIM>
-  inline Matrix<DIM, 1> zerovec() {
-    return matrix::zeromat<DIM, 1>();
+  inline float fromHalf(const cl_half value) {
+    const int exponent = (value >> 10) & 0x1f;
+    const int mantissa = value & 0x3ff;
+
+    float result;
+    if (exponent == 0) {
+      result = std::ldexp(static_cast<float>(mantissa), -24);
+    } else if (exponent == 31) {
+      result = mantissa ? std::numeric_limits<float>::quiet_NaN() : std::numeric_limits<float>::infinity();
+    } else {
+      result = std::ldexp(static_cast<float>(mantissa | 0x400), exponent - 25);
+    }
+    return (value & 0x8000) ? -result : result;
   }
 
-  namespace op {
+  // A W x H matrix stored in half precision, for products that are
+  // limited by memory bandwidth and can afford an 11-bit mantissa
+  template <const dim_t W, const dim_t H>
+  class HalfMatrix {
+  public:
+    explicit HalfMatrix(const Matrix<W, H>& m): matrix(W*H) {
+      std::transform(m.get(), m.get() + m.size(), matrix.begin(), toHalf);
+    }
 
-    namespace {
-      void buildProgram(cl::Context& context, cl::Program& program) {
-        try {
-          program.build();
-        } catch (cl::Error error) {
-          if (error.err() == CL_BUILD_PROGRAM_FAILURE) {
-            std::vector<cl::Device> devices;
-            devices = context.getInfo<CL_CONTEXT_DEVICES>();
-            std::string built = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]);
-            std::cerr << built << "\n";
+    cl::Buffer createBuffer(cl::Context& context, const cl_mem_flags flags) const {
+      return cl::Buffer(context, flags, this->size() * sizeof(cl_half),
+                        const_cast<cl_half*>(matrix.data()));
+    }
+
+    Matrix<W, H> toFloat() const {
+      Matrix<W, H> m;
+      std::transform(matrix.begin(), matrix.end(), m.get(), fromHalf);
+      return m;
+    }
+
+    const cl_half* get() const {
+      return matrix.data();
+    }
+
+    dim_t getHeight() const {
+      return H;
+    }
+
+    dim_t getWidth() const {
+      return W;
+    }
+
+    dim_t size() const {
+      return W*H;
+    }
+
+  private:
+    std::vector<cl_half> matrix;
+  };
+
+  // A W x H matrix quantized to int8, with one scale and zero point per
+  // row or per column:  value = scale * (q - zeroPoint).  The range of
+  // each group is widened to include 0, so that zero is exact.
+  template <const dim_t W, const dim_t H>
+  class QuantizedMatrix {
+  public:
+    enum Axis { PerRow, PerColumn };
+
+    QuantizedMatrix(const Matrix<W, H>& m, const Axis axis):
+      axis(axis), matrix(W*H), scales(axis == PerRow ? H : W), zeroPoints(scales.size()) {
+      const dim_t count = (axis == PerRow) ? W : H;
+      const dim_t step = (axis == PerRow) ? 1 : W;
+
+      for (dim_t group = 0; group < scales.size(); ++group) {
+        const dim_t first = (axis == PerRow) ? group*W : group;
+        float lo = 0.0f;
+        float hi = 0.0f;
+        for (dim_t n = 0; n < count; ++n) {
+          lo = std::min(lo, m.get()[first + n*step]);
+          hi = std::max(hi, m.get()[first + n*step]);
+        }
+        // lo maps to -128 and hi to 127
+        const float scale = (hi > lo) ? (hi - lo) / 255.0f : 1.0f;
+        const cl_int zeroPoint = static_cast<cl_int>(std::lround(-128.0f - lo / scale));
+        for (dim_t n = 0; n < count; ++n) {
+          const long q = std::lround(m.get()[first + n*step] / scale) + zeroPoint;
+          matrix[first + n*step] = static_cast<cl_char>(std::min(127L, std::max(-128L, q)));
+        }
+        scales[group] = scale;
+        zeroPoints[group] = zeroPoint;
+      }
+    }
+
+    cl::Buffer createBuffer(cl::Context& context, const cl_mem_flags flags) const {
+      return cl::Buffer(context, flags, this->size() * sizeof(cl_char),
+                        const_cast<cl_char*>(matrix.data()));
+    }
+
+    cl::Buffer createScalesBuffer(cl::Context& context, const cl_mem_flags flags) const {
+      return cl::Buffer(context, flags, scales.size() * sizeof(float),
+                        const_cast<float*>(scales.data()));
+    }
+
+    cl::Buffer createZeroPointsBuffer(cl::Context& context, const cl_mem_flags flags) const {
+      return cl::Buffer(context, flags, zeroPoints.size() * sizeof(cl_int),
+                        const_cast<cl_int*>(zeroPoints.data()));
+    }
+
+    Matrix<W, H> toFloat() const {
+      Matrix<W, H> m;
+      for (dim_t i = 0; i < this->size(); ++i) {
+        const dim_t group = (axis == PerRow) ? i / W : i % W;
+        m.get()[i] = scales[group] * (matrix[i] - zeroPoints[group]);
+      }
+      return m;
+    }
+
+    Axis getAxis() const {
+      return axis;
+    }
+
+    const cl_char* get() const {
+      return matrix.data();
+    }
+
+    dim_t getHeight() const {
+      return H;
+    }
+
+    dim_t getWidth() const {
+      return W;
+    }
+
+    dim_t size() const {
+      return W*H;
+    }
+
+  private:
+    Axis axis;
+    std::vector<cl_char> matrix;
+    std::vector<float> scales;
+    std::vector<cl_int> zeroPoints;
+  };
+
+  // A buffer of the elements of data.  OpenCL has no empty buffers, so
+  // empty data, such as the nonzeros of a zero matrix, gets a
+  // one-element buffer that is never read.
+  template <typename T>
+  inline cl::Buffer createVectorBuffer(cl::Context& context, const cl_mem_flags flags, const std::vector<T>& data) {
+    if (data.empty()) {
+      return cl::Buffer(context, flags & ~(CL_MEM_COPY_HOST_PTR|CL_MEM_USE_HOST_PTR), sizeof(T));
+    }
+    return cl::Buffer(context, flags, data.size() * sizeof(T), const_cast<T*>(data.data()));
+  }
+
+  // Device copies of the arrays of a sparse matrix in CSR form
+  struct CsrBuffers {
+    cl::Buffer rowPtr;
+    cl::Buffer colIdx;
+    cl::Buffer values;
+  };
+
+  // A sparse W x H matrix in compressed sparse row (CSR) form: the
+  // nonzeros of row r are values[rowPtr[r]] to values[rowPtr[r+1]-1],
+  // in the columns given by colIdx at the same positions
+  template <const dim_t W, const dim_t H>
+  class CsrMatrix {
+  public:
+    // Keeps the nonzeros of m
+    explicit CsrMatrix(const Matrix<W, H>& m): rowPtr(1, 0) {
+      const float* p = m.get();
+      for (dim_t r = 0; r < H; ++r) {
+        for (dim_t c = 0; c < W; ++c) {
+          if (p[r*W + c] != 0.0f) {
+            colIdx.push_back(c);
+            values.push_back(p[r*W + c]);
           }
-          throw error;
         }
+        rowPtr.push_back(colIdx.size());
       }
+    }
 
-      class Context {
-      public:
-        Context():
-          context(DEVICE),
-          program_mat(context, "matmul_kernel.cl"),
-          program_vec(context, "matvec_mul.cl"),
-          queue(context) {
-          buildProgram(context, program_mat);
-          buildProgram(context, program_vec);
+    CsrMatrix(std::vector<cl_int> rowPtr, std::vector<cl_int> colIdx, std::vector<float> values):
+      rowPtr(std::move(rowPtr)), colIdx(std::move(colIdx)), values(std::move(values)) {
+      if (this->rowPtr.size() != H + 1 || this->colIdx.size() != this->values.size() ||
+          this->rowPtr.front() != 0 || this->rowPtr.back() != static_cast<cl_int>(this->values.size()) ||
+          !std::is_sorted(this->rowPtr.begin(), this->rowPtr.end()) ||
+          std::any_of(this->colIdx.begin(), this->colIdx.end(),
+                      [](const cl_int c) { return c < 0 || c >= static_cast<cl_int>(W); })) {
+        throw std::invalid_argument("inconsistent CSR arrays");
+      }
+    }
+
+    CsrBuffers createBuffers(cl::Context& context, const cl_mem_flags flags) const {
+      return CsrBuffers{createVectorBuffer(context, flags, rowPtr),
+                        createVectorBuffer(context, flags, colIdx),
+                        createVectorBuffer(context, flags, values)};
+    }
+
+    Matrix<W, H> toDense() const {
+      Matrix<W, H> m;
+      std::fill_n(m.get(), m.size(), 0.0f);
+      for (dim_t r = 0; r < H; ++r) {
+        for (cl_int j = rowPtr[r]; j < rowPtr[r + 1]; ++j) {
+          m.get()[r*W + colIdx[j]] = values[j];
         }
+      }
+      return m;
+    }
 
-        cl::Context context;
-        cl::Program program_mat;
-        cl::Program program_vec;
-        cl::CommandQueue queue;
-      };
-    } // enclosed
+    const std::vector<cl_int>& getRowPtr() const {
+      return rowPtr;
+    }
 
-    static Context g_ctx;
+    const std::vector<cl_int>& getColIdx() const {
+      return colIdx;
+    }
 
-    template<const dim_t AW, const dim_t AH, const dim_t BW, const dim_t BH>
-    matrix::Matrix<AW, BH> multiply(const matrix::Matrix<AW, AH>& matA, const matrix::Matrix<BW, BH>& matB) {
-      try {
-        auto& context = g_ctx.context;
-        auto& program = g_ctx.program_mat;
-        auto& queue = g_ctx.queue;
-        auto mmul = cl::make_kernel<int, cl::Buffer, cl::Buffer, cl::Buffer,
-                                    cl::LocalSpaceArg, cl::LocalSpaceArg>(program, "mmul");
+    const std::vector<float>& getValues() const {
+      return values;
+    }
 
-        auto result = matrix::zeromat<AW, BH>();
+    dim_t nonZeros() const {
+      return values.size();
+    }
 
-        cl::Buffer cl_matA = matA.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
-        cl::Buffer cl_matB = matB.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
-        cl::Buffer cl_result = result.createBuffer(context, CL_MEM_WRITE_ONLY);
+    dim_t getHeight() const {
+      return H;
+    }
 
-        int blocksize = 16;
-        cl::LocalSpaceArg A_block = cl::Local(sizeof(float) * blocksize*blocksize);
-        cl::LocalSpaceArg B_block = cl::Local(sizeof(float) * blocksize*blocksize);
+    dim_t getWidth() const {
+      return W;
+    }
 
-        mmul(
-          cl::EnqueueArgs(queue,
-                          cl::NDRange(matA.getWidth(),
-                                      matA.getHeight()),
-                          cl::NDRange(blocksize, blocksize)),
-          matA.getWidth(),
-          cl_matA,
-          cl_matB,
-          cl_result,
-          A_block,
-          B_block);
+  private:
+    std::vector<cl_int> rowPtr;
+    std::vector<cl_int> colIdx;
+    std::vector<float> values;
+  };
 
-        queue.enqueueReadBuffer(cl_result, CL_TRUE, 0,
-                                matA.size() * sizeof(float), result.get());
-        return result;
-      } catch (cl::Error err) {
-        std::cout << "Exception\n";
-        std::cerr
-          << "ERROR: "
-          << err.what()
-          << "(" << err.err() << ")"
-          << std::endl;
-        throw;
+  // A sparse W x H matrix in CSR form whose arrays are in device
+  // memory, as the conversions of matrix::op build it, so that it can
+  // be converted further or multiplied without a round trip through
+  // the host
+  template <const dim_t W, const dim_t H>
+  class DeviceCsrMatrix {
+  public:
+    DeviceCsrMatrix(const CsrBuffers& buffers, const dim_t nonZeros):
+      buffers(buffers), count(nonZeros) {
+    }
+
+    DeviceCsrMatrix(cl::Context& context, const CsrMatrix<W, H>& m):
+      buffers(m.createBuffers(context, CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR)), count(m.nonZeros()) {
+    }
+
+    // Copies the arrays back to the host
+    CsrMatrix<W, H> read(cl::CommandQueue& queue) const {
+      std::vector<cl_int> rowPtr(H + 1);
+      std::vector<cl_int> colIdx(count);
+      std::vector<float> values(count);
+      queue.enqueueReadBuffer(buffers.rowPtr, CL_TRUE, 0, rowPtr.size() * sizeof(cl_int), rowPtr.data());
+      if (count > 0) {
+        queue.enqueueReadBuffer(buffers.colIdx, CL_TRUE, 0, count * sizeof(cl_int), colIdx.data());
+        queue.enqueueReadBuffer(buffers.values, CL_TRUE, 0, count * sizeof(float), values.data());
       }
+      return CsrMatrix<W, H>(std::move(rowPtr), std::move(colIdx), std::move(values));
     }
 
-    template<const dim_t AW, const dim_t AH, const dim_t BDIM>
-    matrix::Matrix<AW, 1> multiply(const matrix::Matrix<AW, AH>& mat, const matrix::Matrix<BDIM, 1>& vec) {
-      try {
-        auto& context = g_ctx.context;
-        auto& program = g_ctx.program_vec;
-        auto& queue = g_ctx.queue;
-        auto mmul =
-          cl::make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, int>(program, "matrixVectorMul");
+    CsrBuffers getBuffers() const {
+      return buffers;
+    }
 
-        auto result_vector = matrix::zerovec<AW>();
+    dim_t nonZeros() const {
+      return count;
+    }
 
-        cl::Buffer cl_mat = mat.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
-        cl::Buffer cl_vec = vec.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
-        cl::Buffer cl_result_vector = result_vector.createBuffer(context, CL_MEM_WRITE_ONLY);
+    dim_t getHeight() const {
+      return H;
+    }
 
-        mmul(
-          cl::EnqueueArgs(queue, cl::NDRange(mat.getHeight())),
+    dim_t getWidth() const {
+      return W;
+    }
+
+  private:
+    CsrBuffers buffers;
+    dim_t count;
+  };
+
+  // Device copies of the arrays of a block-sparse matrix in BSR form
+  struct BsrBuffers {
+    cl::Buffer blockRowPtr;
+    cl::Buffer blockCol;
+    cl::Buffer blocks;
+  };
+
+  // A block-sparse W x H matrix in block sparse row (BSR) form: the
+  // matrix is cut into blocksize x blocksize blocks, and only those
+  // with a nonzero are kept.  The blocks of block row r are numbers
+  // blockRowPtr[r] to blockRowPtr[r+1]-1, in the block columns given
+  // by blockCol at the same positions.  Each one takes blocksize^2
+  // floats of blocks, row-major, with zeros past the edges of the
+  // matrix.
+  template <const dim_t W, const dim_t H>
+  class BsrMatrix {
+  public:
+    explicit BsrMatrix(const Matrix<W, H>& m, const dim_t blocksize = 16):
+      blocksize(blocksize), blockRowPtr(1, 0) {
+      if (blocksize == 0) {
+        throw std::invalid_argument("BSR block size must be positive");
+      }
+      const float* p = m.get();
+      for (dim_t r0 = 0; r0 < H; r0 += blocksize) {
+        const dim_t rows = std::min(blocksize, H - r0);
+        for (dim_t c0 = 0; c0 < W; c0 += blocksize) {
+          const dim_t cols = std::min(blocksize, W - c0);
+          bool nonzero = false;
+          for (dim_t r = 0; r < rows && !nonzero; ++r) {
+            nonzero = std::any_of(p + (r0 + r)*W + c0, p + (r0 + r)*W + c0 + cols,
+                                  [](const float x) { return x != 0.0f; });
+          }
+          if (!nonzero) {
+            continue;
+          }
+          blockCol.push_back(c0 / blocksize);
+          const dim_t first = blocks.size();
+          blocks.resize(first + blocksize*blocksize, 0.0f);
+          for (dim_t r = 0; r < rows; ++r) {
+            std::copy_n(p + (r0 + r)*W + c0, cols, &blocks[first + r*blocksize]);
+          }
+        }
+        blockRowPtr.push_back(blockCol.size());
+      }
+    }
+
+    BsrBuffers createBuffers(cl::Context& context, const cl_mem_flags flags) const {
+      return BsrBuffers{createVectorBuffer(context, flags, blockRowPtr),
+                        createVectorBuffer(context, flags, blockCol),
+                        createVectorBuffer(context, flags, blocks)};
+    }
+
+    Matrix<W, H> toDense() const {
+      Matrix<W, H> m;
+      std::fill_n(m.get(), m.size(), 0.0f);
+      for (dim_t br = 0; br + 1 < blockRowPtr.size(); ++br) {
+        const dim_t r0 = br * blocksize;
+        const dim_t rows = std::min(blocksize, H - r0);
+        for (cl_int n = blockRowPtr[br]; n < blockRowPtr[br + 1]; ++n) {
+          const dim_t c0 = blockCol[n] * blocksize;
+          const dim_t cols = std::min(blocksize, W - c0);
+          for (dim_t r = 0; r < rows; ++r) {
+            std::copy_n(&blocks[n*blocksize*blocksize + r*blocksize], cols, m.get() + (r0 + r)*W + c0);
+          }
+        }
+      }
+      return m;
+    }
+
+    const std::vector<cl_int>& getBlockRowPtr() const {
+      return blockRowPtr;
+    }
+
+    const std::vector<cl_int>& getBlockCol() const {
+      return blockCol;
+    }
+
+    const std::vector<float>& getBlocks() const {
+      return blocks;
+    }
+
+    dim_t getBlockSize() const {
+      return blocksize;
+    }
+
+    dim_t nonZeroBlocks() const {
+      return blockCol.size();
+    }
+
+    dim_t getHeight() const {
+      return H;
+    }
+
+    dim_t getWidth() const {
+      return W;
+    }
+
+  private:
+    dim_t blocksize;
+    std::vector<cl_int> blockRowPtr;
+    std::vector<cl_int> blockCol;
+    std::vector<float> blocks;
+  };
+
+  // Device copies of the arrays of a sparse matrix in SELL-C-sigma form
+  struct SellBuffers {
+    cl::Buffer sliceStart;
+    cl::Buffer colIdx;
+    cl::Buffer values;
+    cl::Buffer rowPerm;
+  };
+
+  // A sparse W x H matrix in sliced ELLPACK (SELL-C-sigma) form.  The
+  // rows are sorted by their number of nonzeros, longest first, within
+  // windows of sigma rows, and cut into slices of chunk rows.  Each
+  // slice is padded to its longest row and stored column by column, so
+  // that element j of the lane'th row of slice s is at
+  //   sliceStart[s] + j*chunk + lane
+  // and the rows of a slice are read side by side.  Padding has value 0
+  // in column 0.  Row i of the sorted order is row rowPerm[i] of the
+  // matrix.  Sorting keeps rows of similar length in the same slice,
+  // which is what limits the padding; a larger sigma pads less but
+  // scatters the result more.
+  template <const dim_t W, const dim_t H>
+  class SellMatrix {
+  public:
+    explicit SellMatrix(const CsrMatrix<W, H>& m, const dim_t chunk = 32, const dim_t sigma = 256):
+      chunk(chunk), rowPerm(H) {
+      if (chunk == 0 || sigma == 0) {
+        throw std::invalid_argument("SELL chunk and sigma must be positive");
+      }
+      const std::vector<cl_int>& rowPtr = m.getRowPtr();
+      auto length = [&rowPtr](const cl_int r) { return rowPtr[r + 1] - rowPtr[r]; };
+
+      std::iota(rowPerm.begin(), rowPerm.end(), 0);
+      for (dim_t w = 0; w < H; w += sigma) {
+        std::stable_sort(rowPerm.begin() + w, rowPerm.begin() + std::min(w + sigma, H),
+                         [&length](const cl_int a, const cl_int b) { return length(a) > length(b); });
+      }
+
+      sliceStart.push_back(0);
+      for (dim_t first = 0; first < H; first += chunk) {
+        cl_int width = 0;
+        for (dim_t i = first; i < std::min(first + chunk, H); ++i) {
+          width = std::max(width, length(rowPerm[i]));
+        }
+        sliceStart.push_back(sliceStart.back() + width * chunk);
+      }
+
+      colIdx.assign(sliceStart.back(), 0);
+      values.assign(sliceStart.back(), 0.0f);
+      for (dim_t i = 0; i < H; ++i) {
+        const cl_int r = rowPerm[i];
+        const cl_int start = sliceStart[i / chunk] + i % chunk;
+        for (cl_int j = 0; j < length(r); ++j) {
+          colIdx[start + j*chunk] = m.getColIdx()[rowPtr[r] + j];
+          values[start + j*chunk] = m.getValues()[rowPtr[r] + j];
+        }
+      }
+    }
+
+    SellBuffers createBuffers(cl::Context& context, const cl_mem_flags flags) const {
+      return SellBuffers{createVectorBuffer(context, flags, sliceStart),
+                         createVectorBuffer(context, flags, colIdx),
+                         createVectorBuffer(context, flags, values),
+                         createVectorBuffer(context, flags, rowPerm)};
+    }
+
+    Matrix<W, H> toDense() const {
+      Matrix<W, H> m;
+      std::fill_n(m.get(), m.size(), 0.0f);
+      for (dim_t i = 0; i < H; ++i) {
+        const dim_t s = i / chunk;
+        for (cl_int j = sliceStart[s] + i % chunk; j < sliceStart[s + 1]; j += chunk) {
+          m.get()[rowPerm[i]*W + colIdx[j]] += values[j];
+        }
+      }
+      return m;
+    }
+
+    const std::vector<cl_int>& getSliceStart() const {
+      return sliceStart;
+    }
+
+    const std::vector<cl_int>& getColIdx() const {
+      return colIdx;
+    }
+
+    const std::vector<float>& getValues() const {
+      return values;
+    }
+
+    const std::vector<cl_int>& getRowPerm() const {
+      return rowPerm;
+    }
+
+    dim_t getChunk() const {
+      return chunk;
+    }
+
+    // Stored elements, padding included
+    dim_t storedElements() const {
+      return values.size();
+    }
+
+    dim_t getHeight() const {
+      return H;
+    }
+
+    dim_t getWidth() const {
+      return W;
+    }
+
+  private:
+    dim_t chunk;
+    std::vector<cl_int> sliceStart;
+    std::vector<cl_int> colIdx;
+    std::vector<float> values;
+    std::vector<cl_int> rowPerm;
+  };
+
+  namespace op {
+
+    // Work fused into the store of a product, so that
+    //   C = scale * activation(A*B + bias)
+    // takes a single pass over C.  Each kind of epilogue is a separate
+    // build of the kernels; plain products never pay for it.
+    struct Epilogue {
+      enum Activation { Identity, ReLU, GELU, Sigmoid, Clamp };
+      enum Bias { NoBias, RowBias, ColumnBias };
+
+      Epilogue(const Activation activation = Identity, const float scale = 1.0f,
+               const float lo = 0.0f, const float hi = 0.0f):
+        activation(activation), scale(scale), lo(lo), hi(hi) {
+      }
+
+      // lo and hi bound the output of Clamp
+      Activation activation;
+      float scale;
+      float lo;
+      float hi;
+
+      std::string buildOptions(const Bias bias) const {
+        return " -Depilogue_bias=" + std::to_string(bias) +
+          " -Depilogue_act=" + std::to_string(activation);
+      }
+    };
+
+    namespace {
+      void buildProgram(cl::Context& context, cl::Program& program, const std::string& options = "") {
+        try {
+          program.build(options.c_str());
+        } catch (cl::Error error) {
+          if (error.err() == CL_BUILD_PROGRAM_FAILURE) {
+            std::vector<cl::Device> devices;
+            devices = context.getInfo<CL_CONTEXT_DEVICES>();
+            std::string built = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]);
+            std::cerr << built << "\n";
+          }
+          throw error;
+        }
+      }
+
+      // Whether mmul and mmul_vec (workPerThread 1) or mmul_reg with this
+      // tile shape fit within the device's work-group and local memory
+      // limits, allowing for the padding of the mmul_vec blocks
+      bool fitsDevice(const cl::Device& device, const int blocksize, const int workPerThread) {
+        const ::size_t maxGroup = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+        const std::vector< ::size_t> maxItems = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+        const cl_ulong localMem = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+
+        const ::size_t edge = blocksize;
+        return (edge*edge <= maxGroup &&
+                edge <= maxItems[0] && edge <= maxItems[1] &&
+                2*sizeof(float)*(blocksize+1)*blocksize*workPerThread <= localMem);
+      }
+
+      // Largest block size the device can run, starting from the one
+      // that suits its type: 32 on a CPU, 16 everywhere else.  mmul_reg
+      // keeps two blocksize x blocksize*workPerThread panels in local memory.
+      int selectBlockSize(const cl::Device& device, const int workPerThread) {
+        const cl_device_type type = device.getInfo<CL_DEVICE_TYPE>();
+
+        int blocksize = (type & CL_DEVICE_TYPE_CPU) ? 32 : 16;
+        while (blocksize > 1 && !fitsDevice(device, blocksize, workPerThread)) {
+          blocksize /= 2;
+        }
+        return blocksize;
+      }
+
+      inline int roundUp(const int value, const int multiple) {
+        return (value + multiple - 1) / multiple * multiple;
+      }
+
+      // Launches C = alpha*A*B + beta*C for an M x K matrix A and a K x N
+      // matrix B with the fastest kernel the shape allows: mmul_reg when
+      // config asks for a micro-tile and the shape is made of whole tiles,
+      // mmul_vec when it asks for vector loads and everything is aligned
+      // to them, and the edge-checking mmul otherwise.  Programs built
+      // with an epilogue take its arguments as extra.
+      template<typename... Extra>
+      cl::Event enqueueMmul(cl::CommandQueue& queue, cl::Program& program, const KernelConfig& config,
+                            const int M, const int N, const int K, const float alpha,
+                            cl::Buffer& A, const int lda, cl::Buffer& B, const int ldb,
+                            const float beta, cl::Buffer& C, const int ldc, Extra... extra) {
+        const int blocksize = config.blocksize;
+        const int tilesize = blocksize*config.workPerThread;
+        const int vectorWidth = config.vectorWidth;
+
+        auto mmul = [&](const char* name, const cl::NDRange& global, const cl::NDRange& local,
+                        const ::size_t blockBytes) {
+          auto kernel = cl::make_kernel<int, int, int, float, cl::Buffer, int, cl::Buffer, int,
+                                        float, cl::Buffer, int,
+                                        cl::LocalSpaceArg, cl::LocalSpaceArg, Extra...>(program, name);
+          return kernel(
+            cl::EnqueueArgs(queue, global, local),
+            M, N, K, alpha,
+            A, lda,
+            B, ldb,
+            beta, C, ldc,
+            cl::Local(blockBytes),
+            cl::Local(blockBytes),
+            extra...);
+        };
+
+        if (config.workPerThread > 1 &&
+            M % tilesize == 0 && N % tilesize == 0 && K % blocksize == 0) {
+          return mmul("mmul_reg",
+                      cl::NDRange(N / config.workPerThread, M / config.workPerThread),
+                      cl::NDRange(blocksize, blocksize),
+                      sizeof(float) * tilesize*blocksize);
+        }
+        if (vectorWidth > 1 && blocksize % vectorWidth == 0 &&
+            M % blocksize == 0 && N % blocksize == 0 && K % blocksize == 0 &&
+            lda % vectorWidth == 0 && ldb % vectorWidth == 0 && ldc % vectorWidth == 0) {
+          // Local blocks are padded by one float per row, see lpad
+          return mmul("mmul_vec",
+                      cl::NDRange(N / vectorWidth, M),
+                      cl::NDRange(blocksize / vectorWidth, blocksize),
+                      sizeof(float) * (blocksize+1)*blocksize);
+        }
+        return mmul("mmul",
+                    cl::NDRange(roundUp(N, blocksize), roundUp(M, blocksize)),
+                    cl::NDRange(blocksize, blocksize),
+                    sizeof(float) * blocksize*blocksize);
+      }
+
+      // Launches C[b] = alpha*A[b]*B[b] + beta*C[b] for every matrix b of a
+      // batch, with the batch index in the third dimension of the NDRange
+      inline cl::Event enqueueMmulBatched(cl::CommandQueue& queue, cl::Program& program, const KernelConfig& config,
+                                   const int M, const int N, const int K, const int count,
+                                   const float alpha,
+                                   cl::Buffer& A, const int lda, const int strideA,
+                                   cl::Buffer& B, const int ldb, const int strideB,
+                                   const float beta,
+                                   cl::Buffer& C, const int ldc, const int strideC) {
+        const int blocksize = config.blocksize;
+
+        auto mmul = cl::make_kernel<int, int, int, float,
+                                    cl::Buffer, int, int, cl::Buffer, int, int, float, cl::Buffer, int, int,
+                                    cl::LocalSpaceArg, cl::LocalSpaceArg>(program, "mmul_batched");
+
+        return mmul(
+          cl::EnqueueArgs(queue,
+                          cl::NDRange(roundUp(N, blocksize), roundUp(M, blocksize), count),
+                          cl::NDRange(blocksize, blocksize, 1)),
+          M, N, K, alpha,
+          A, lda, strideA,
+          B, ldb, strideB,
+          beta, C, ldc, strideC,
+          cl::Local(sizeof(float) * blocksize*blocksize),
+          cl::Local(sizeof(float) * blocksize*blocksize));
+      }
+
+      // Launches C = alpha*A*B + beta*C on mmul_systolic, which runs as a
+      // single work-item
+      cl::Event enqueueSystolic(cl::CommandQueue& queue, cl::Program& program,
+                                const int M, const int N, const int K, const float alpha,
+                                cl::Buffer& A, const int lda, cl::Buffer& B, const int ldb,
+                                const float beta, cl::Buffer& C, const int ldc) {
+        auto mmul = cl::make_kernel<int, int, int, float, cl::Buffer, int, cl::Buffer, int,
+                                    float, cl::Buffer, int>(program, "mmul_systolic");
+
+        return mmul(
+          cl::EnqueueArgs(queue, cl::NDRange(1), cl::NDRange(1)),
+          M, N, K, alpha,
+          A, lda,
+          B, ldb,
+          beta, C, ldc);
+      }
+
+      // Whether a vector of width floats fits in constant memory
+      bool fitsConstant(const cl::Device& device, const int width) {
+        return sizeof(float) * width <= device.getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>();
+      }
+
+      // Build options of matvec_mul.cl for products with vectors of width
+      // floats.  matrixVectorMul, which runs when config gives each row a
+      // work-item, reads the vector from constant memory if it can; the
+      // other kernels stage it in local memory and build the same way for
+      // every width.
+      std::string matvecOptions(const cl::Device& device, const KernelConfig& config, const int width) {
+        const bool constant = config.workPerThread == 1 && fitsConstant(device, width);
+        return config.buildOptions() + (constant ? " -Dxspace=__constant" : "");
+      }
+
+      // Launches result = mat*vec for a rows x width matrix, on
+      // matrixVectorMulRow when config shares rows between work-items.
+      // Otherwise it runs matrixVectorMul if the vector fits in constant
+      // memory and matrixVectorMulLocal if not.  The program must be built
+      // with matvecOptions.
+      cl::Event enqueueMatrixVectorMul(cl::CommandQueue& queue, cl::Program& program, const KernelConfig& config,
+                                       const int rows, const int width,
+                                       cl::Buffer& mat, cl::Buffer& vec, cl::Buffer& result) {
+        if (config.workPerThread > 1) {
+          const int lanes = config.workPerThread;
+          const int rowsPerGroup = config.blocksize / lanes;
+          auto mv =
+            cl::make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, int, int,
+                            cl::LocalSpaceArg, cl::LocalSpaceArg>(program, "matrixVectorMulRow");
+
+          return mv(
+            cl::EnqueueArgs(queue,
+                            cl::NDRange(lanes, roundUp(rows, rowsPerGroup)),
+                            cl::NDRange(lanes, rowsPerGroup)),
+            result,
+            mat,
+            vec,
+            width,
+            rows,
+            cl::Local(sizeof(float) * config.blocksize),
+            cl::Local(sizeof(float) * config.blocksize*config.vectorWidth)
+            );
+        }
+
+        if (!fitsConstant(queue.getInfo<CL_QUEUE_DEVICE>(), width)) {
+          // The chunks of the vector need an explicit work-group size
+          const int groupsize = config.blocksize ? config.blocksize : 64;
+          auto mv =
+            cl::make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, int, int, cl::LocalSpaceArg>(program, "matrixVectorMulLocal");
+
+          return mv(
+            cl::EnqueueArgs(queue, cl::NDRange(roundUp(rows, groupsize)), cl::NDRange(groupsize)),
+            result,
+            mat,
+            vec,
+            width,
+            rows,
+            cl::Local(sizeof(float) * groupsize*config.vectorWidth)
+            );
+        }
+
+        auto mmul =
+          cl::make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, int>(program, "matrixVectorMul");
+
+        return mmul(
+          cl::EnqueueArgs(queue, cl::NDRange(rows),
+                          config.blocksize ? cl::NDRange(config.blocksize) : cl::NullRange),
+          result,
+          mat,
+          vec,
+          width
+          );
+      }
+
+      // Launches result = mat*vecs for a rows x width matrix and a width x
+      // vectors block of vectors on matrixVectorMulBlock.  The program
+      // must be built with -Dnvec=vectors.
+      cl::Event enqueueMatrixVectorMulBlock(cl::CommandQueue& queue, cl::Program& program, const KernelConfig& config,
+                                            const int rows, const int width, const int vectors,
+                                            cl::Buffer& mat, cl::Buffer& vecs, cl::Buffer& result) {
+        // The reduction needs an explicit work-group size
+        const int lanes = config.workPerThread;
+        const int groupsize = config.blocksize ? config.blocksize : 64;
+        const int rowsPerGroup = groupsize / lanes;
+        auto mv =
+          cl::make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, int, int,
+                          cl::LocalSpaceArg, cl::LocalSpaceArg>(program, "matrixVectorMulBlock");
+
+        return mv(
+          cl::EnqueueArgs(queue,
+                          cl::NDRange(lanes, roundUp(rows, rowsPerGroup)),
+                          cl::NDRange(lanes, rowsPerGroup)),
+          result,
+          mat,
+          vecs,
+          width,
+          rows,
+          cl::Local(sizeof(float) * groupsize*vectors),
+          cl::Local(sizeof(float) * groupsize*vectors)
+          );
+      }
+
+      // Launches result = mat*vec for a CSR matrix with rows rows.  Rows
+      // averaging fewer than 8 nonzeros get a work-item each; longer ones
+      // are shared by a power of two work-items, up to 32, no more than
+      // their average.
+      inline cl::Event enqueueCsrMatrixVectorMul(cl::CommandQueue& queue, cl::Program& program,
+                                          const int rows, const int nonZeros,
+                                          CsrBuffers& mat, cl::Buffer& vec, cl::Buffer& result) {
+        const int average = nonZeros / rows;
+        if (average < 8) {
+          auto mv = cl::make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, int>(
+            program, "csrMatrixVectorMul");
+          return mv(
+            cl::EnqueueArgs(queue, cl::NDRange(rows)),
+            result, mat.rowPtr, mat.colIdx, mat.values, vec, rows);
+        }
+
+        const cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+        const int groupsize = std::min< ::size_t>(128, device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+        int lanes = 8;
+        while (lanes < 32 && 2*lanes <= average) {
+          lanes *= 2;
+        }
+        // The lanes of a row must fit in a work-group, and remain a power
+        // of two for the reduction
+        while (lanes > groupsize) {
+          lanes /= 2;
+        }
+        const int rowsPerGroup = groupsize / lanes;
+        auto mv = cl::make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, int,
+                                  cl::LocalSpaceArg>(program, "csrMatrixVectorMulRow");
+        return mv(
+          cl::EnqueueArgs(queue,
+                          cl::NDRange(lanes, roundUp(rows, rowsPerGroup)),
+                          cl::NDRange(lanes, rowsPerGroup)),
+          result, mat.rowPtr, mat.colIdx, mat.values, vec, rows,
+          cl::Local(sizeof(float) * lanes*rowsPerGroup));
+      }
+
+      // Launches result = mat*vec for a SELL matrix with rows rows, one
+      // work-item per row in sorted order and, when the device allows
+      // it, one work-group per slice
+      inline cl::Event enqueueSellMatrixVectorMul(cl::CommandQueue& queue, cl::Program& program,
+                                           const int rows, const int chunk,
+                                           SellBuffers& mat, cl::Buffer& vec, cl::Buffer& result) {
+        auto mv = cl::make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
+                                  int, int>(program, "sellMatrixVectorMul");
+        const cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+        const bool fits = static_cast<size_t>(chunk) <= device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+        return mv(
+          cl::EnqueueArgs(queue,
+                          cl::NDRange(roundUp(rows, chunk)),
+                          fits ? cl::NDRange(chunk) : cl::NullRange),
+          result, mat.sliceStart, mat.colIdx, mat.values, mat.rowPerm, vec, rows, chunk);
+      }
+
+      // Launches C = A*B for a sparse M x K A and a dense K x N B, in
+      // tiles of 32 columns of B for narrow B and 64 otherwise
+      cl::Event enqueueCsrMatrixMul(cl::CommandQueue& queue, cl::Program& program,
+                                    const int M, const int N, CsrBuffers& A,
+                                    cl::Buffer& B, const int ldb, cl::Buffer& C, const int ldc) {
+        const cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+        const int maxGroup = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+        const int lanes = std::min(N <= 32 ? 32 : 64, maxGroup);
+        auto mm = cl::make_kernel<int, int, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, int, cl::Buffer, int,
+                                  cl::LocalSpaceArg, cl::LocalSpaceArg>(program, "csrMatrixMul");
+        return mm(
+          cl::EnqueueArgs(queue, cl::NDRange(roundUp(N, lanes), M), cl::NDRange(lanes, 1)),
+          M, N, A.rowPtr, A.colIdx, A.values, B, ldb, C, ldc,
+          cl::Local(sizeof(cl_int) * lanes), cl::Local(sizeof(float) * lanes));
+      }
+
+      // Launches the values of S .* (A*B) for an M x K A and an M x N
+      // sparse S with nonZeros nonzeros.  Rows of S share work-items
+      // like enqueueCsrMatrixVectorMul's, a power of two up to 32 of
+      // them, no more than the average nonzeros per row.
+      cl::Event enqueueCsrSampledMatrixMul(cl::CommandQueue& queue, cl::Program& program,
+                                           const int M, const int K, const int nonZeros, CsrBuffers& S,
+                                           cl::Buffer& A, const int lda, cl::Buffer& B, const int ldb,
+                                           cl::Buffer& values) {
+        const cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+        const int groupsize = std::min< ::size_t>(64, device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+        const int average = nonZeros / M;
+        int lanes = 1;
+        while (lanes < 32 && 2*lanes <= average && 2*lanes <= groupsize) {
+          lanes *= 2;
+        }
+        const int rowsPerGroup = groupsize / lanes;
+        auto mm = cl::make_kernel<int, int, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, int,
+                                  cl::Buffer, int, cl::Buffer>(program, "csrSampledMatrixMul");
+        return mm(
+          cl::EnqueueArgs(queue,
+                          cl::NDRange(lanes, roundUp(M, rowsPerGroup)),
+                          cl::NDRange(lanes, rowsPerGroup)),
+          M, K, S.rowPtr, S.colIdx, S.values, A, lda, B, ldb, values);
+      }
+
+      // Scans the n ints of data in place, inclusively: a scan within
+      // each work-group, then, for more than one, a scan of their
+      // totals that is added back
+      void enqueueScan(cl::CommandQueue& queue, cl::Program& program, cl::Context& context,
+                       cl::Buffer& data, const int n) {
+        const cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+        const int groupsize = std::min< ::size_t>(256, device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+        const int groups = (n + groupsize - 1) / groupsize;
+
+        cl::Buffer sums(context, CL_MEM_READ_WRITE, sizeof(cl_int) * groups);
+        auto scan = cl::make_kernel<cl::Buffer, int, cl::Buffer, cl::LocalSpaceArg>(program, "scanBlocks");
+        scan(
+          cl::EnqueueArgs(queue, cl::NDRange(groups*groupsize), cl::NDRange(groupsize)),
+          data, n, sums, cl::Local(sizeof(cl_int) * groupsize));
+        if (groups == 1) {
+          return;
+        }
+
+        enqueueScan(queue, program, context, sums, groups);
+        auto add = cl::make_kernel<cl::Buffer, int, cl::Buffer>(program, "addBlockSums");
+        add(
+          cl::EnqueueArgs(queue, cl::NDRange(groups*groupsize), cl::NDRange(groupsize)),
+          data, n, sums);
+      }
+
+      // The rows+1 row pointers of a CSR matrix with nonzero i in row
+      // rowIdx[i]: a count of the nonzeros of each row, then its scan
+      cl::Buffer enqueueRowPointers(cl::CommandQueue& queue, cl::Program& program, cl::Context& context,
+                                    const int rows, cl::Buffer& rowIdx, const int n) {
+        std::vector<cl_int> zeros(rows + 1, 0);
+        cl::Buffer rowPtr = createVectorBuffer(context, CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR, zeros);
+        if (n > 0) {
+          auto count = cl::make_kernel<cl::Buffer, cl::Buffer, int>(program, "countEntries");
+          count(cl::EnqueueArgs(queue, cl::NDRange(n)), rowPtr, rowIdx, n);
+          enqueueScan(queue, program, context, rowPtr, rows + 1);
+        }
+        return rowPtr;
+      }
+
+      // The CSR arrays of the n COO entries (rowIdx[i], colIdx[i],
+      // values[i]) of a matrix of rows x width, sorted by row and then
+      // by column with a bitonic sort of their positions as keys.
+      // Duplicate entries are kept, so they add up in products.
+      CsrBuffers enqueueCooToCsr(cl::CommandQueue& queue, cl::Program& program, cl::Context& context,
+                                 const int rows, const int width, cl::Buffer& rowIdx,
+                                 cl::Buffer& colIdx, cl::Buffer& values, const int n) {
+        const int padded = sizeBucket(n);
+        CsrBuffers csr{enqueueRowPointers(queue, program, context, rows, rowIdx, n),
+                       cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * std::max(n, 1)),
+                       cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * std::max(n, 1))};
+        if (n == 0) {
+          return csr;
+        }
+
+        cl::Buffer keys(context, CL_MEM_READ_WRITE, sizeof(cl_ulong) * padded);
+        cl::Buffer perm(context, CL_MEM_READ_WRITE, sizeof(cl_int) * padded);
+        auto makeKeys = cl::make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, int, int>(
+          program, "makeSortKeys");
+        makeKeys(cl::EnqueueArgs(queue, cl::NDRange(padded)), keys, perm, rowIdx, colIdx, n, width);
+
+        auto sortStep = cl::make_kernel<cl::Buffer, cl::Buffer, int, int>(program, "bitonicSortStep");
+        for (int k = 2; k <= padded; k <<= 1) {
+          for (int j = k >> 1; j > 0; j >>= 1) {
+            sortStep(cl::EnqueueArgs(queue, cl::NDRange(padded)), keys, perm, j, k);
+          }
+        }
+
+        auto gather = cl::make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, int, int>(
+          program, "gatherSorted");
+        gather(cl::EnqueueArgs(queue, cl::NDRange(n)), csr.colIdx, csr.values, keys, perm, values, n, width);
+        return csr;
+      }
+
+      // Launches result = mat^T*vec for a rows x width matrix, in two
+      // steps when there are enough rows to split between work-groups:
+      // column sums over slabs of rows into partial, then their totals
+      cl::Event enqueueMatrixTransposeVectorMul(cl::CommandQueue& queue, cl::Program& program,
+                                                cl::Context& context, const int rows, const int width,
+                                                cl::Buffer& mat, cl::Buffer& vec, cl::Buffer& result) {
+        const cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+        const int groupsize = std::min< ::size_t>(64, device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+        // Slabs of at least 64 rows, at most 256 of them
+        const int slabs = std::max(1, std::min(rows / 64, 256));
+        const int chunk = (rows + slabs - 1) / slabs;
+
+        auto mv = cl::make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, int, int, int>(program, "matrixTransposeVectorMul");
+        if (slabs == 1) {
+          return mv(
+            cl::EnqueueArgs(queue, cl::NDRange(roundUp(width, groupsize), 1), cl::NDRange(groupsize, 1)),
+            result, mat, vec, width, rows, chunk);
+        }
+
+        cl::Buffer partial(context, CL_MEM_READ_WRITE, sizeof(float) * slabs*width);
+        mv(
+          cl::EnqueueArgs(queue, cl::NDRange(roundUp(width, groupsize), slabs), cl::NDRange(groupsize, 1)),
+          partial, mat, vec, width, rows, chunk);
+
+        auto reduce = cl::make_kernel<cl::Buffer, cl::Buffer, int, int>(program, "reduceColumns");
+        return reduce(
+          cl::EnqueueArgs(queue, cl::NDRange(roundUp(width, groupsize)), cl::NDRange(groupsize)),
+          result, partial, width, slabs);
+      }
+
+      // C = alpha*A + beta*B over M x N blocks that start offA, offB and
+      // offC elements into their buffers
+      cl::Event enqueueMadd(cl::CommandQueue& queue, cl::Program& program, const int M, const int N,
+                            const float alpha, cl::Buffer& A, const int offA, const int lda,
+                            const float beta, cl::Buffer& B, const int offB, const int ldb,
+                            cl::Buffer& C, const int offC, const int ldc) {
+        auto madd = cl::make_kernel<int, int, float, cl::Buffer, int, int, float, cl::Buffer, int, int,
+                                    cl::Buffer, int, int>(program, "madd");
+
+        return madd(
+          cl::EnqueueArgs(queue, cl::NDRange(N, M)),
+          M, N,
+          alpha, A, offA, lda,
+          beta, B, offB, ldb,
+          C, offC, ldc);
+      }
+
+      // Copies the rows x cols block of src whose top left element is at
+      // (row, col) into the contiguous buffer dst
+      void copyBlock(cl::CommandQueue& queue, cl::Buffer& src, const int ld,
+                     const int row, const int col, const int rows, const int cols, cl::Buffer& dst) {
+        cl::size_t<3> srcOrigin;
+        srcOrigin[0] = col * sizeof(float);
+        srcOrigin[1] = row;
+        cl::size_t<3> dstOrigin;
+        cl::size_t<3> region;
+        region[0] = cols * sizeof(float);
+        region[1] = rows;
+        region[2] = 1;
+        queue.enqueueCopyBufferRect(src, dst, srcOrigin, dstOrigin, region,
+                                    ld * sizeof(float), 0, cols * sizeof(float), 0);
+      }
+
+      // C = A*B for contiguous M x K, K x N and M x N buffers by the
+      // Winograd form of Strassen's algorithm.  It recurses while all
+      // three dimensions are even and larger than crossover, and leaves
+      // the rest to enqueueMmul.  Everything stays on the device.
+      void strassen(cl::Context& context, cl::CommandQueue& queue, cl::Program& program,
+                    const KernelConfig& config, const int M, const int N, const int K,
+                    cl::Buffer& A, cl::Buffer& B, cl::Buffer& C, const int crossover) {
+        if (M % 2 || N % 2 || K % 2 || std::min({M, N, K}) <= crossover) {
+          enqueueMmul(queue, program, config, M, N, K, 1.0f, A, K, B, N, 0.0f, C, N);
+          return;
+        }
+        const int m = M/2;
+        const int n = N/2;
+        const int k = K/2;
+
+        // Offsets of the quadrants
+        const int a11 = 0, a12 = k, a21 = m*K, a22 = m*K + k;
+        const int b11 = 0, b12 = n, b21 = k*N, b22 = k*N + n;
+        const int c11 = 0, c12 = n, c21 = m*N, c22 = m*N + n;
+
+        auto block = [&](const int rows, const int cols) {
+          return cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * rows*cols);
+        };
+
+        cl::Buffer S1 = block(m, k), S2 = block(m, k), S3 = block(m, k), S4 = block(m, k);
+        enqueueMadd(queue, program, m, k, 1.0f, A, a21, K, 1.0f, A, a22, K, S1, 0, k);
+        enqueueMadd(queue, program, m, k, 1.0f, S1, 0, k, -1.0f, A, a11, K, S2, 0, k);
+        enqueueMadd(queue, program, m, k, 1.0f, A, a11, K, -1.0f, A, a21, K, S3, 0, k);
+        enqueueMadd(queue, program, m, k, 1.0f, A, a12, K, -1.0f, S2, 0, k, S4, 0, k);
+
+        cl::Buffer T1 = block(k, n), T2 = block(k, n), T3 = block(k, n), T4 = block(k, n);
+        enqueueMadd(queue, program, k, n, 1.0f, B, b12, N, -1.0f, B, b11, N, T1, 0, n);
+        enqueueMadd(queue, program, k, n, 1.0f, B, b22, N, -1.0f, T1, 0, n, T2, 0, n);
+        enqueueMadd(queue, program, k, n, 1.0f, B, b22, N, -1.0f, B, b12, N, T3, 0, n);
+        enqueueMadd(queue, program, k, n, 1.0f, T2, 0, n, -1.0f, B, b21, N, T4, 0, n);
+
+        // mmul wants the quadrants that are multiplied as they are
+        // in buffers of their own
+        cl::Buffer A11 = block(m, k), A12 = block(m, k), A22 = block(m, k);
+        cl::Buffer B11 = block(k, n), B21 = block(k, n), B22 = block(k, n);
+        copyBlock(queue, A, K, 0, 0, m, k, A11);
+        copyBlock(queue, A, K, 0, k, m, k, A12);
+        copyBlock(queue, A, K, m, k, m, k, A22);
+        copyBlock(queue, B, N, 0, 0, k, n, B11);
+        copyBlock(queue, B, N, k, 0, k, n, B21);
+        copyBlock(queue, B, N, k, n, k, n, B22);
+
+        cl::Buffer P1 = block(m, n), P2 = block(m, n), P3 = block(m, n), P4 = block(m, n);
+        cl::Buffer P5 = block(m, n), P6 = block(m, n), P7 = block(m, n);
+        strassen(context, queue, program, config, m, n, k, A11, B11, P1, crossover);
+        strassen(context, queue, program, config, m, n, k, A12, B21, P2, crossover);
+        strassen(context, queue, program, config, m, n, k, S4, B22, P3, crossover);
+        strassen(context, queue, program, config, m, n, k, A22, T4, P4, crossover);
+        strassen(context, queue, program, config, m, n, k, S1, T1, P5, crossover);
+        strassen(context, queue, program, config, m, n, k, S2, T2, P6, crossover);
+        strassen(context, queue, program, config, m, n, k, S3, T3, P7, crossover);
+
+        // C11 = P1 + P2, and with U2 = P1 + P6 in P6 and U3 = U2 + P7
+        // in P7, C12 = U2 + P5 + P3, C21 = U3 - P4 and C22 = U3 + P5
+        enqueueMadd(queue, program, m, n, 1.0f, P1, 0, n, 1.0f, P2, 0, n, C, c11, N);
+        enqueueMadd(queue, program, m, n, 1.0f, P1, 0, n, 1.0f, P6, 0, n, P6, 0, n);
+        enqueueMadd(queue, program, m, n, 1.0f, P6, 0, n, 1.0f, P7, 0, n, P7, 0, n);
+        enqueueMadd(queue, program, m, n, 1.0f, P6, 0, n, 1.0f, P5, 0, n, P6, 0, n);
+        enqueueMadd(queue, program, m, n, 1.0f, P6, 0, n, 1.0f, P3, 0, n, C, c12, N);
+        enqueueMadd(queue, program, m, n, 1.0f, P7, 0, n, -1.0f, P4, 0, n, C, c21, N);
+        enqueueMadd(queue, program, m, n, 1.0f, P7, 0, n, 1.0f, P5, 0, n, C, c22, N);
+      }
+
+      // Whether the device is an Intel FPGA board or the FPGA emulator.
+      // Their runtimes do not compile OpenCL C; they only load images
+      // built offline by aoc.
+      bool isFpga(const cl::Device& device) {
+        const cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+        return platform.getInfo<CL_PLATFORM_NAME>().find("FPGA") != std::string::npos ||
+          device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_intel_channels") != std::string::npos;
+      }
+
+      // The offline-built image of file for an FPGA, named after the file
+      // and its build options: systolic_mmul.cl with -Dpe_rows=8
+      // -Dpe_cols=8 is systolic_mmul.pe_rows=8.pe_cols=8.aocx, in the
+      // directory MATRIXCL_AOCX_DIR, if set, or the current one
+      std::string fpgaImage(const std::string& file, const std::string& options) {
+        const char* dir = std::getenv("MATRIXCL_AOCX_DIR");
+        std::string image = dir ? std::string(dir) + "/" : "";
+        image += file.substr(0, file.rfind(".cl"));
+        std::istringstream tokens(options);
+        std::string token;
+        while (tokens >> token) {
+          image += "." + token.substr(token.compare(0, 2, "-D") == 0 ? 2 : 1);
+        }
+        return image + ".aocx";
+      }
+
+      // Whether the device runs kernels connected by OpenCL 2.0 pipes,
+      // which are optional again from OpenCL 3.0 on
+      bool supportsPipes(const cl::Device& device) {
+#ifdef CL_VERSION_2_0
+        const std::string version = device.getInfo<CL_DEVICE_VERSION>();
+        const int major = std::atoi(version.c_str() + std::strlen("OpenCL "));
+        if (major < 2) {
+          return false;
+        }
+#ifdef CL_VERSION_3_0
+        if (major >= 3) {
+          cl_bool support = CL_FALSE;
+          clGetDeviceInfo(device(), CL_DEVICE_PIPE_SUPPORT, sizeof(support), &support, nullptr);
+          return support == CL_TRUE;
+        }
+#endif
+        return true;
+#else
+        return false;
+#endif
+      }
+
+#ifdef CL_VERSION_2_0
+      cl::Memory createPipe(cl::Context& context, const cl_uint packets) {
+        cl_int error;
+        cl_mem pipe = clCreatePipe(context(), CL_MEM_READ_WRITE, sizeof(cl_float), packets, nullptr, &error);
+        if (error != CL_SUCCESS) {
+          throw cl::Error(error, "clCreatePipe");
+        }
+        return cl::Memory(pipe);
+      }
+#endif
+
+      // The kernels of pipe_mmul.cl, each launched as a task.  Connected
+      // by pipes they take them as extra arguments; connected by Intel
+      // channels they take none.
+      template<typename... Pipe>
+      cl::Event enqueueReader(cl::CommandQueue& queue, cl::Program& program,
+                              const int M, const int N, const int K,
+                              cl::Buffer& A, const int lda, cl::Buffer& B, const int ldb, Pipe&... pipes) {
+        auto reader = cl::make_kernel<int, int, int, cl::Buffer, int, cl::Buffer, int, Pipe...>(program, "mmul_reader");
+        return reader(cl::EnqueueArgs(queue, cl::NDRange(1), cl::NDRange(1)),
+                      M, N, K, A, lda, B, ldb, pipes...);
+      }
+
+      template<typename... Pipe>
+      cl::Event enqueueCompute(cl::CommandQueue& queue, cl::Program& program,
+                               const int M, const int N, const int K, Pipe&... pipes) {
+        auto compute = cl::make_kernel<int, int, int, Pipe...>(program, "mmul_compute");
+        return compute(cl::EnqueueArgs(queue, cl::NDRange(1), cl::NDRange(1)),
+                       M, N, K, pipes...);
+      }
+
+      template<typename... Pipe>
+      cl::Event enqueueWriter(cl::CommandQueue& queue, cl::Program& program,
+                              const int M, const int N, const float alpha, const float beta,
+                              cl::Buffer& C, const int ldc, Pipe&... pipes) {
+        auto writer = cl::make_kernel<int, int, float, float, cl::Buffer, int, Pipe...>(program, "mmul_writer");
+        return writer(cl::EnqueueArgs(queue, cl::NDRange(1), cl::NDRange(1)),
+                      M, N, alpha, beta, C, ldc, pipes...);
+      }
+
+      // Average device time in nanoseconds of the command issued by launch,
+      // after one untimed warm-up run.  Needs a profiling-enabled queue.
+      template<typename Launch>
+      cl_ulong profile(Launch launch, const unsigned int iters) {
+        launch().wait();
+
+        cl_ulong total = 0;
+        for (unsigned int i = 0; i < iters; ++i) {
+          cl::Event event = launch();
+          event.wait();
+          total += (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+                    event.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+        }
+        return total / iters;
+      }
+
+      class Context {
+      public:
+        Context():
+          context(DEVICE),
+          device(context.getInfo<CL_CONTEXT_DEVICES>()[0]),
+          queue(context, device),
+          loadQueue(context, device),
+          drainQueue(context, device),
+          tuning(tuningFile()) {
+          const int blocksize = selectBlockSize(device, 4);
+          mmulDefaults = KernelConfig{blocksize, 4, 4, blocksize};
+          // Outside of CPUs, whose caches suit a work-item per row,
+          // rows are read by 32 work-items together
+          if (device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU) {
+            mvDefaults = KernelConfig{0, 1, 1, 1};
+          } else {
+            const ::size_t maxGroup = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+            int groupsize = 128;
+            while (groupsize > 32 && static_cast< ::size_t>(groupsize) > maxGroup) {
+              groupsize /= 2;
+            }
+            mvDefaults = KernelConfig{groupsize, std::min(groupsize, 32), 1, 1};
+          }
+          fp64 = device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_fp64") != std::string::npos;
+          fpga = isFpga(device);
+          // MATRIXCL_SYSTOLIC set to anything but 0 forces the FPGA kernel
+          // onto any device, so that it can be checked on a CPU runtime
+          // such as pocl.  Other accelerators, such as Xeon Phi, keep mmul.
+          const char* forceSystolic = std::getenv("MATRIXCL_SYSTOLIC");
+          systolic = fpga || (forceSystolic && *forceSystolic && std::strcmp(forceSystolic, "0") != 0);
+          systolicDefaults = SystolicConfig{8, 8};
+          channels = device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_intel_channels") != std::string::npos;
+          pipes = supportsPipes(device);
+
+          if (systolic) {
+            program("systolic_mmul.cl", systolicDefaults.buildOptions());
+          } else {
+            program("matmul_kernel.cl", mmulDefaults.buildOptions());
+          }
+          // An FPGA only has the kernels of the images built for it
+          if (!fpga) {
+            matvecProgram();
+          }
+        }
+
+        // matvec_mul.cl as dense products build it with the default
+        // configuration and a vector that fits constant memory, as most
+        // do.  The sparse products, which do not depend on the vector's
+        // memory, share it.
+        cl::Program& matvecProgram() {
+          return program("matvec_mul.cl", matvecOptions(device, mvDefaults, 1));
+        }
+
+        // Builds each kernel file once per set of build options, or on an
+        // FPGA loads the image built from it with them (see fpgaImage)
+        cl::Program& program(const std::string& file, const std::string& options) {
+          const std::string key = file + " " + options;
+          auto entry = programs.find(key);
+          if (entry == programs.end()) {
+            cl::Program program = fpga ? loadImage(fpgaImage(file, options))
+                                       : cl::Program(context, util::loadProgram(file));
+            buildProgram(context, program, fpga ? "" : options);
+            entry = programs.insert(std::make_pair(key, program)).first;
+          }
+          return entry->second;
+        }
+
+        std::string tuningKey(const std::string& kernel, const dim_t size) const {
+          return TuningDb::key(device.getInfo<CL_DEVICE_NAME>(),
+                               device.getInfo<CL_DRIVER_VERSION>(),
+                               kernel, sizeBucket(size));
+        }
+
+        // The tuned configuration of kernel for this problem size, if the
+        // tuning file has one for this device, otherwise the default one
+        KernelConfig config(const std::string& kernel, const dim_t size) const {
+          KernelConfig tuned;
+          if (tuning.lookup(tuningKey(kernel, size), tuned)) {
+            return tuned;
+          }
+          return kernel == "mmul" ? mmulDefaults : mvDefaults;
+        }
+
+        cl::Context context;
+        cl::Device device;
+        cl::CommandQueue queue;
+        // The reader and writer of multiply_pipelined run beside queue
+        cl::CommandQueue loadQueue;
+        cl::CommandQueue drainQueue;
+        TuningDb tuning;
+        KernelConfig mmulDefaults;
+        KernelConfig mvDefaults;
+        // Whether the device has the double precision kernels
+        bool fp64;
+        // Whether kernels come from offline-built images (see isFpga)
+        bool fpga;
+        // Whether plain products run on mmul_systolic rather than mmul
+        bool systolic;
+        SystolicConfig systolicDefaults;
+        // How the kernels of multiply_pipelined can be connected, if at all
+        bool channels;
+        bool pipes;
+
+      private:
+        cl::Program loadImage(const std::string& image) {
+          if (!std::ifstream(image.c_str()).is_open()) {
+            throw std::runtime_error("no FPGA image " + image + "; build it with aoc");
+          }
+          const std::pair<const void*, ::size_t> binary = util::loadProgramBinary(image);
+          cl::Program program(context, std::vector<cl::Device>(1, device),
+                              cl::Program::Binaries(1, binary));
+          delete[] static_cast<const char*>(binary.first);
+          return program;
+        }
+
+        std::map<std::string, cl::Program> programs;
+      };
+    } // enclosed
+
+    static Context g_ctx;
+
+    // Times every variant of mmul and matrixVectorMul that fits the device
+    // on problems of the given size, and records the fastest of each in the
+    // tuning file so that later runs in the same size bucket use them.
+    inline void autotune(const dim_t size, const unsigned int iters = 5) {
+      try {
+        auto& context = g_ctx.context;
+        auto& device = g_ctx.device;
+        cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+
+        std::vector<float> host(size * size);
+        auto gen = std::bind(std::uniform_real_distribution<float>(0.0f, 1.0f), std::default_random_engine());
+        std::generate(host.begin(), host.end(), gen);
+
+        const ::size_t bytes = host.size() * sizeof(float);
+        cl::Buffer cl_matA(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR, bytes, host.data());
+        cl::Buffer cl_matB(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR, bytes, host.data());
+        cl::Buffer cl_result(context, CL_MEM_WRITE_ONLY, bytes);
+        cl::Buffer cl_vec(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR, size * sizeof(float), host.data());
+        cl::Buffer cl_result_vector(context, CL_MEM_WRITE_ONLY, size * sizeof(float));
+
+        KernelConfig best = g_ctx.mmulDefaults;
+        cl_ulong bestTime = std::numeric_limits<cl_ulong>::max();
+        for (int blocksize : {8, 16, 32}) {
+          for (int workPerThread : {1, 2, 4, 8}) {
+            for (int vectorWidth : {1, 4, 8}) {
+              for (int unroll : {1, 4, blocksize}) {
+                // Vector loads are only used by mmul_vec, which runs when
+                // there is no micro-tile
+                if (size % (blocksize*workPerThread) != 0 ||
+                    (vectorWidth > 1 && (workPerThread > 1 || blocksize % vectorWidth != 0)) ||
+                    !fitsDevice(device, blocksize, workPerThread)) {
+                  continue;
+                }
+                const KernelConfig candidate{blocksize, workPerThread, vectorWidth, unroll};
+                try {
+                  auto& program = g_ctx.program("matmul_kernel.cl", candidate.buildOptions());
+                  const cl_ulong time = profile([&]() {
+                      return enqueueMmul(queue, program, candidate, size, size, size, 1.0f,
+                                         cl_matA, size, cl_matB, size, 0.0f, cl_result, size);
+                    }, iters);
+                  if (time < bestTime) {
+                    best = candidate;
+                    bestTime = time;
+                  }
+                } catch (cl::Error err) {
+                  // The device rejected this variant, e.g. out of registers
+                }
+              }
+            }
+          }
+        }
+        g_ctx.tuning.store(g_ctx.tuningKey("mmul", size), best);
+
+        best = g_ctx.mvDefaults;
+        bestTime = std::numeric_limits<cl_ulong>::max();
+        const ::size_t maxGroup = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+        for (int groupsize : {0, 32, 64, 128, 256}) {
+          for (int lanes : {1, 8, 32, 64}) {
+            for (int vectorWidth : {1, 2, 4}) {
+              for (int unroll : {1, 4, 8}) {
+                // Shared rows need a work-group of whole rows
+                if (size % vectorWidth != 0 ||
+                    (groupsize && (size % groupsize != 0 || static_cast< ::size_t>(groupsize) > maxGroup)) ||
+                    (lanes > 1 && (groupsize == 0 || groupsize % lanes != 0))) {
+                  continue;
+                }
+                const KernelConfig candidate{groupsize, lanes, vectorWidth, unroll};
+                try {
+                  auto& program = g_ctx.program("matvec_mul.cl", matvecOptions(device, candidate, size));
+                  const cl_ulong time = profile([&]() {
+                      return enqueueMatrixVectorMul(queue, program, candidate, size, size,
+                                                    cl_matA, cl_vec, cl_result_vector);
+                    }, iters);
+                  if (time < bestTime) {
+                    best = candidate;
+                    bestTime = time;
+                  }
+                } catch (cl::Error err) {
+                }
+              }
+            }
+          }
+        }
+        g_ctx.tuning.store(g_ctx.tuningKey("mv", size), best);
+
+        g_ctx.tuning.save();
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << "(" << err.err() << ")"
+          << std::endl;
+        throw;
+      }
+    }
+
+    enum class Transpose { No, Yes };
+
+    // op(A)*op(B), where op transposes the operands flagged Transpose::Yes.
+    // The kernels read transposed operands directly from their stored
+    // layout, so nothing is transposed on the host or copied on the device.
+    template<const Transpose TA, const Transpose TB,
+             const dim_t AW, const dim_t AH, const dim_t BW, const dim_t BH>
+    matrix::Matrix<TB == Transpose::Yes ? BH : BW, TA == Transpose::Yes ? AW : AH>
+    multiply(const matrix::Matrix<AW, AH>& matA, const matrix::Matrix<BW, BH>& matB) {
+      const bool transA = (TA == Transpose::Yes);
+      const bool transB = (TB == Transpose::Yes);
+      const dim_t M = transA ? AW : AH;
+      const dim_t N = transB ? BH : BW;
+      const dim_t K = transA ? AH : AW;
+      static_assert((TA == Transpose::Yes ? AH : AW) == (TB == Transpose::Yes ? BW : BH),
+                    "columns of op(A) must match rows of op(B)");
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        auto result = matrix::zeromat<N, M>();
+
+        cl::Buffer cl_matA = matA.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_matB = matB.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_result = result.createBuffer(context, CL_MEM_WRITE_ONLY);
+
+        if (g_ctx.systolic && !transA && !transB) {
+          auto& program = g_ctx.program("systolic_mmul.cl", g_ctx.systolicDefaults.buildOptions());
+          enqueueSystolic(queue, program, M, N, K, 1.0f,
+                          cl_matA, AW, cl_matB, BW, 0.0f, cl_result, N);
+        } else if (!transA && !transB && N > 1 && N <= 16) {
+          // A few vectors at once: one pass over A serves all of them,
+          // where mmul would pad them out to a whole block
+          const KernelConfig config = g_ctx.config("mv", K);
+          auto& program = g_ctx.program("matvec_mul.cl",
+                                        config.buildOptions() + " -Dnvec=" + std::to_string(N));
+          enqueueMatrixVectorMulBlock(queue, program, config, M, K, N,
+                                      cl_matA, cl_matB, cl_result);
+        } else {
+          KernelConfig config = g_ctx.config("mmul", std::max({M, N, K}));
+          std::string options = config.buildOptions();
+          if (transA || transB) {
+            // mmul_vec loads along the rows of untransposed operands only
+            config.vectorWidth = 1;
+            options = config.buildOptions() +
+              " -Dtrans_a=" + std::to_string(transA) + " -Dtrans_b=" + std::to_string(transB);
+          }
+          auto& program = g_ctx.program("matmul_kernel.cl", options);
+          enqueueMmul(queue, program, config, M, N, K, 1.0f,
+                      cl_matA, AW, cl_matB, BW, 0.0f, cl_result, N);
+        }
+
+        queue.enqueueReadBuffer(cl_result, CL_TRUE, 0,
+                                result.size() * sizeof(float), result.get());
+        return result;
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << "(" << err.err() << ")"
+          << std::endl;
+        throw;
+      }
+    }
+
+    template<const dim_t AW, const dim_t AH, const dim_t BW, const dim_t BH>
+    matrix::Matrix<BW, AH> multiply(const matrix::Matrix<AW, AH>& matA, const matrix::Matrix<BW, BH>& matB) {
+      return multiply<Transpose::No, Transpose::No>(matA, matB);
+    }
+
+    // A*B in double precision, on devices that support cl_khr_fp64.
+    // Overloading on the element type picks the kernel at compile time,
+    // so single precision products are untouched.
+    template<const dim_t AW, const dim_t AH, const dim_t BW, const dim_t BH>
+    matrix::Matrix<BW, AH, double> multiply(const matrix::Matrix<AW, AH, double>& matA,
+                                            const matrix::Matrix<BW, BH, double>& matB) {
+      static_assert(AW == BH, "width of A must match height of B");
+      if (!g_ctx.fp64) {
+        throw std::runtime_error("double precision needs a device with cl_khr_fp64");
+      }
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        const KernelConfig config = g_ctx.config("mmul", std::max({AH, BW, AW}));
+        auto& program = g_ctx.program("matmul_kernel.cl", config.buildOptions());
+        auto mmul = cl::make_kernel<int, int, int, double, cl::Buffer, int, cl::Buffer, int,
+                                    double, cl::Buffer, int,
+                                    cl::LocalSpaceArg, cl::LocalSpaceArg>(program, "mmul_f64");
+
+        auto result = matrix::zeromat<BW, AH, double>();
+
+        cl::Buffer cl_matA = matA.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_matB = matB.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_result = result.createBuffer(context, CL_MEM_WRITE_ONLY);
+
+        const int blocksize = config.blocksize;
+        mmul(
+          cl::EnqueueArgs(queue,
+                          cl::NDRange(roundUp(BW, blocksize), roundUp(AH, blocksize)),
+                          cl::NDRange(blocksize, blocksize)),
+          AH, BW, AW, 1.0,
+          cl_matA, AW,
+          cl_matB, BW,
+          0.0, cl_result, BW,
+          cl::Local(sizeof(double) * blocksize*blocksize),
+          cl::Local(sizeof(double) * blocksize*blocksize));
+
+        queue.enqueueReadBuffer(cl_result, CL_TRUE, 0,
+                                result.size() * sizeof(double), result.get());
+        return result;
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << "(" << err.err() << ")"
+          << std::endl;
+        throw;
+      }
+    }
+
+    // C = alpha*A*B + beta*C, accumulating into C in place.  C is only
+    // uploaded when beta is non-zero.
+    template<const dim_t AW, const dim_t AH, const dim_t BW, const dim_t BH>
+    void multiply(const matrix::Matrix<AW, AH>& matA, const matrix::Matrix<BW, BH>& matB,
+                  matrix::Matrix<BW, AH>& matC, const float alpha, const float beta) {
+      static_assert(AW == BH, "width of A must match height of B");
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        cl::Buffer cl_matA = matA.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_matB = matB.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_matC = matC.createBuffer(context, beta != 0.0f ? CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR
+                                                                     : CL_MEM_WRITE_ONLY);
+
+        if (g_ctx.systolic) {
+          auto& program = g_ctx.program("systolic_mmul.cl", g_ctx.systolicDefaults.buildOptions());
+          enqueueSystolic(queue, program, AH, BW, AW, alpha,
+                          cl_matA, AW, cl_matB, BW, beta, cl_matC, BW);
+        } else {
+          const KernelConfig config = g_ctx.config("mmul", std::max({AH, BW, AW}));
+          auto& program = g_ctx.program("matmul_kernel.cl", config.buildOptions());
+          enqueueMmul(queue, program, config, AH, BW, AW, alpha,
+                      cl_matA, AW, cl_matB, BW, beta, cl_matC, BW);
+        }
+
+        queue.enqueueReadBuffer(cl_matC, CL_TRUE, 0,
+                                matC.size() * sizeof(float), matC.get());
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << "(" << err.err() << ")"
+          << std::endl;
+        throw;
+      }
+    }
+
+    namespace {
+      template<const dim_t AW, const dim_t AH, const dim_t BW, const dim_t BH>
+      matrix::Matrix<BW, AH> multiply_epilogue(const matrix::Matrix<AW, AH>& matA, const matrix::Matrix<BW, BH>& matB,
+                                               const Epilogue& epilogue, const Epilogue::Bias biasKind,
+                                               const float* bias, const dim_t biasSize) {
+        static_assert(AW == BH, "width of A must match height of B");
+        try {
+          auto& context = g_ctx.context;
+          auto& queue = g_ctx.queue;
+          const KernelConfig config = g_ctx.config("mmul", std::max({AH, BW, AW}));
+          auto& program = g_ctx.program("matmul_kernel.cl",
+                                        config.buildOptions() + epilogue.buildOptions(biasKind));
+          auto result = matrix::zeromat<BW, AH>();
+
+          cl::Buffer cl_matA = matA.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+          cl::Buffer cl_matB = matB.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+          cl::Buffer cl_result = result.createBuffer(context, CL_MEM_WRITE_ONLY);
+
+          // Without a bias the kernel gets a NULL bias pointer it never reads
+          cl::Buffer cl_bias;
+          if (bias) {
+            cl_bias = cl::Buffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,
+                                 biasSize * sizeof(float), const_cast<float*>(bias));
+          }
+
+          enqueueMmul(queue, program, config, AH, BW, AW, 1.0f,
+                      cl_matA, AW, cl_matB, BW, 0.0f, cl_result, BW,
+                      cl_bias, epilogue.scale, epilogue.lo, epilogue.hi);
+
+          queue.enqueueReadBuffer(cl_result, CL_TRUE, 0,
+                                  result.size() * sizeof(float), result.get());
+          return result;
+        } catch (cl::Error err) {
+          std::cout << "Exception\n";
+          std::cerr
+            << "ERROR: "
+            << err.what()
+            << "(" << err.err() << ")"
+            << std::endl;
+          throw;
+        }
+      }
+    } // enclosed
+
+    // scale * activation(A*B), fused into the product
+    template<const dim_t AW, const dim_t AH, const dim_t BW, const dim_t BH>
+    matrix::Matrix<BW, AH> multiply(const matrix::Matrix<AW, AH>& matA, const matrix::Matrix<BW, BH>& matB,
+                                    const Epilogue& epilogue) {
+      return multiply_epilogue(matA, matB, epilogue, Epilogue::NoBias, nullptr, 0);
+    }
+
+    // scale * activation(A*B + bias), with the column vector bias adding
+    // one value to each row of the product
+    template<const dim_t AW, const dim_t AH, const dim_t BW, const dim_t BH>
+    matrix::Matrix<BW, AH> multiply(const matrix::Matrix<AW, AH>& matA, const matrix::Matrix<BW, BH>& matB,
+                                    const matrix::Matrix<1, AH>& bias, const Epilogue& epilogue) {
+      return multiply_epilogue(matA, matB, epilogue, Epilogue::RowBias,
+                               bias.get(), bias.size());
+    }
+
+    // scale * activation(A*B + bias), with the row vector bias adding one
+    // value to each column of the product
+    template<const dim_t AW, const dim_t AH, const dim_t BW, const dim_t BH>
+    matrix::Matrix<BW, AH> multiply(const matrix::Matrix<AW, AH>& matA, const matrix::Matrix<BW, BH>& matB,
+                                    const matrix::Matrix<BW, 1>& bias, const Epilogue& epilogue) {
+      return multiply_epilogue(matA, matB, epilogue, Epilogue::ColumnBias,
+                               bias.get(), bias.size());
+    }
+
+    // A*B for half precision operands, accumulated and returned in single
+    // precision
+    template<const dim_t AW, const dim_t AH, const dim_t BW, const dim_t BH>
+    matrix::Matrix<BW, AH> multiply(const matrix::HalfMatrix<AW, AH>& matA, const matrix::HalfMatrix<BW, BH>& matB) {
+      static_assert(AW == BH, "width of A must match height of B");
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        const KernelConfig config = g_ctx.config("mmul", std::max({AH, BW, AW}));
+        auto& program = g_ctx.program("matmul_kernel.cl", config.buildOptions());
+        auto mmul = cl::make_kernel<int, int, int, float, cl::Buffer, int, cl::Buffer, int,
+                                    float, cl::Buffer, int,
+                                    cl::LocalSpaceArg, cl::LocalSpaceArg>(program, "mmul_half");
+
+        auto result = matrix::zeromat<BW, AH>();
+
+        cl::Buffer cl_matA = matA.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_matB = matB.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_result = result.createBuffer(context, CL_MEM_WRITE_ONLY);
+
+        const int blocksize = config.blocksize;
+        mmul(
+          cl::EnqueueArgs(queue,
+                          cl::NDRange(roundUp(BW, blocksize), roundUp(AH, blocksize)),
+                          cl::NDRange(blocksize, blocksize)),
+          AH, BW, AW, 1.0f,
+          cl_matA, AW,
+          cl_matB, BW,
+          0.0f, cl_result, BW,
+          cl::Local(sizeof(float) * blocksize*blocksize),
+          cl::Local(sizeof(float) * blocksize*blocksize));
+
+        queue.enqueueReadBuffer(cl_result, CL_TRUE, 0,
+                                result.size() * sizeof(float), result.get());
+        return result;
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << "(" << err.err() << ")"
+          << std::endl;
+        throw;
+      }
+    }
+
+    // A*B for int8 operands, accumulated exactly in int32 and dequantized
+    // in single precision.  The scales only factor out of the sum when A
+    // is quantized per row and B per column.
+    template<const dim_t AW, const dim_t AH, const dim_t BW, const dim_t BH>
+    matrix::Matrix<BW, AH> multiply(const matrix::QuantizedMatrix<AW, AH>& matA,
+                                    const matrix::QuantizedMatrix<BW, BH>& matB) {
+      static_assert(AW == BH, "width of A must match height of B");
+      if (matA.getAxis() != matrix::QuantizedMatrix<AW, AH>::PerRow ||
+          matB.getAxis() != matrix::QuantizedMatrix<BW, BH>::PerColumn) {
+        throw std::invalid_argument("int8 multiply needs A quantized per row and B per column");
+      }
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        const KernelConfig config = g_ctx.config("mmul", std::max({AH, BW, AW}));
+        auto& program = g_ctx.program("matmul_kernel.cl", config.buildOptions());
+        auto mmul = cl::make_kernel<int, int, int, float,
+                                    cl::Buffer, int, cl::Buffer, cl::Buffer,
+                                    cl::Buffer, int, cl::Buffer, cl::Buffer,
+                                    float, cl::Buffer, int,
+                                    cl::LocalSpaceArg, cl::LocalSpaceArg>(program, "mmul_i8");
+
+        auto result = matrix::zeromat<BW, AH>();
+
+        cl::Buffer cl_matA = matA.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_scaleA = matA.createScalesBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_zeroA = matA.createZeroPointsBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_matB = matB.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_scaleB = matB.createScalesBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_zeroB = matB.createZeroPointsBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_result = result.createBuffer(context, CL_MEM_WRITE_ONLY);
+
+        const int blocksize = config.blocksize;
+        mmul(
+          cl::EnqueueArgs(queue,
+                          cl::NDRange(roundUp(BW, blocksize), roundUp(AH, blocksize)),
+                          cl::NDRange(blocksize, blocksize)),
+          AH, BW, AW, 1.0f,
+          cl_matA, AW, cl_scaleA, cl_zeroA,
+          cl_matB, BW, cl_scaleB, cl_zeroB,
+          0.0f, cl_result, BW,
+          cl::Local(sizeof(cl_int) * blocksize*blocksize),
+          cl::Local(sizeof(cl_int) * blocksize*blocksize));
+
+        queue.enqueueReadBuffer(cl_result, CL_TRUE, 0,
+                                result.size() * sizeof(float), result.get());
+        return result;
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << "(" << err.err() << ")"
+          << std::endl;
+        throw;
+      }
+    }
+
+    // Multiplies every pair of matrices in two batches with a single
+    // launch, which for small matrices costs far less than COUNT calls
+    // to multiply()
+    template<const dim_t AW, const dim_t AH, const dim_t BW, const dim_t BH, const dim_t COUNT>
+    matrix::MatrixBatch<BW, AH, COUNT> multiply_batched(const matrix::MatrixBatch<AW, AH, COUNT>& batchA,
+                                                        const matrix::MatrixBatch<BW, BH, COUNT>& batchB) {
+      static_assert(AW == BH, "width of A must match height of B");
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        const KernelConfig config = g_ctx.config("mmul", std::max({AH, BW, AW}));
+        auto& program = g_ctx.program("matmul_kernel.cl", config.buildOptions());
+        auto result = matrix::zerobatch<BW, AH, COUNT>();
+
+        cl::Buffer cl_batchA = batchA.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_batchB = batchB.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_result = result.createBuffer(context, CL_MEM_WRITE_ONLY);
+
+        enqueueMmulBatched(queue, program, config, AH, BW, AW, COUNT, 1.0f,
+                           cl_batchA, AW, batchA.stride(),
+                           cl_batchB, BW, batchB.stride(),
+                           0.0f, cl_result, BW, result.stride());
+
+        queue.enqueueReadBuffer(cl_result, CL_TRUE, 0,
+                                result.size() * sizeof(float), result.get());
+        return result;
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << "(" << err.err() << ")"
+          << std::endl;
+        throw;
+      }
+    }
+
+    // A*B on three kernels connected by pipes, which overlap reading A and
+    // B, the arithmetic and writing C (see pipe_mmul.cl).  They use Intel
+    // channels where the device has them and OpenCL 2.0 pipes otherwise;
+    // with neither this is plain multiply().  Channels only exist on FPGA
+    // runtimes, which load the image pipe_mmul.blksz=16.use_channels.aocx
+    // instead of building the kernels, so there blksz is not tuned.
+    template<const dim_t AW, const dim_t AH, const dim_t BW, const dim_t BH>
+    matrix::Matrix<BW, AH> multiply_pipelined(const matrix::Matrix<AW, AH>& matA, const matrix::Matrix<BW, BH>& matB) {
+      static_assert(AW == BH, "width of A must match height of B");
+      if (!g_ctx.channels && !g_ctx.pipes) {
+        return multiply(matA, matB);
+      }
+      try {
+        auto& context = g_ctx.context;
+        const int blocksize = g_ctx.fpga ? 16 : g_ctx.config("mmul", std::max({AH, BW, AW})).blocksize;
+        const std::string options = "-Dblksz=" + std::to_string(blocksize) +
+          (g_ctx.channels ? " -Duse_channels" : " -cl-std=CL2.0");
+        auto& program = g_ctx.program("pipe_mmul.cl", options);
+        auto result = matrix::zeromat<BW, AH>();
+
+        cl::Buffer cl_matA = matA.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_matB = matB.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_result = result.createBuffer(context, CL_MEM_WRITE_ONLY);
+
+        if (g_ctx.channels) {
+          enqueueReader(g_ctx.loadQueue, program, AH, BW, AW, cl_matA, AW, cl_matB, BW);
+          enqueueCompute(g_ctx.queue, program, AH, BW, AW);
+          enqueueWriter(g_ctx.drainQueue, program, AH, BW, 1.0f, 0.0f, cl_result, BW);
+        }
+#ifdef CL_VERSION_2_0
+        else {
+          // Room for two blocks, so that each kernel can work a block
+          // ahead of the next one
+          const cl_uint packets = 2*blocksize*blocksize;
+          cl::Memory pipeA = createPipe(context, packets);
+          cl::Memory pipeB = createPipe(context, packets);
+          cl::Memory pipeC = createPipe(context, packets);
+
+          enqueueReader(g_ctx.loadQueue, program, AH, BW, AW, cl_matA, AW, cl_matB, BW, pipeA, pipeB);
+          enqueueCompute(g_ctx.queue, program, AH, BW, AW, pipeA, pipeB, pipeC);
+          enqueueWriter(g_ctx.drainQueue, program, AH, BW, 1.0f, 0.0f, cl_result, BW, pipeC);
+        }
+#endif
+        // None of the kernels can finish on its own, so all three are
+        // submitted before waiting for the writer
+        g_ctx.loadQueue.flush();
+        g_ctx.queue.flush();
+        g_ctx.drainQueue.enqueueReadBuffer(cl_result, CL_TRUE, 0,
+                                           result.size() * sizeof(float), result.get());
+        return result;
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << "(" << err.err() << ")"
+          << std::endl;
+        throw;
+      }
+    }
+
+    // A*B by Strassen's algorithm in Winograd's form, which replaces each
+    // product of halves by 7 products and 15 additions instead of 8
+    // products.  Products whose smallest dimension is at most crossover,
+    // or odd, are left to mmul.  Each level of recursion costs some
+    // accuracy, so the crossover should not be set lower than needed.
+    template<const dim_t AW, const dim_t AH, const dim_t BW, const dim_t BH>
+    matrix::Matrix<BW, AH> multiply_strassen(const matrix::Matrix<AW, AH>& matA, const matrix::Matrix<BW, BH>& matB,
+                                             const dim_t crossover = 2048) {
+      static_assert(AW == BH, "width of A must match height of B");
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        // The products at the bottom of the recursion are the ones to tune for
+        const KernelConfig config = g_ctx.config("mmul", std::min(std::max({AH, BW, AW}), crossover));
+        auto& program = g_ctx.program("matmul_kernel.cl", config.buildOptions());
+        auto result = matrix::zeromat<BW, AH>();
+
+        cl::Buffer cl_matA = matA.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_matB = matB.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_result = result.createBuffer(context, CL_MEM_WRITE_ONLY);
+
+        strassen(context, queue, program, config, AH, BW, AW, cl_matA, cl_matB, cl_result, crossover);
+
+        queue.enqueueReadBuffer(cl_result, CL_TRUE, 0,
+                                result.size() * sizeof(float), result.get());
+        return result;
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << "(" << err.err() << ")"
+          << std::endl;
+        throw;
+      }
+    }
+
+    // mat*vec, one element per row of mat
+    template<const dim_t AW, const dim_t AH, const dim_t BDIM>
+    matrix::Matrix<AH, 1> multiply(const matrix::Matrix<AW, AH>& mat, const matrix::Matrix<BDIM, 1>& vec) {
+      static_assert(AW == BDIM, "width of the matrix must match the length of the vector");
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        KernelConfig config = g_ctx.config("mv", mat.getWidth());
+        // matrixVectorMul is the one kernel that needs whole work-groups,
+        // and it only runs with the vector in constant memory
+        if (mat.getWidth() % config.vectorWidth != 0 ||
+            (config.blocksize && config.workPerThread == 1 && fitsConstant(g_ctx.device, AW) &&
+             mat.getHeight() % config.blocksize != 0)) {
+          config = g_ctx.mvDefaults;
+        }
+        auto& program = g_ctx.program("matvec_mul.cl", matvecOptions(g_ctx.device, config, AW));
+
+        auto result_vector = matrix::zerovec<AH>();
+
+        cl::Buffer cl_mat = mat.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_vec = vec.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_result_vector = result_vector.createBuffer(context, CL_MEM_WRITE_ONLY);
+
+        enqueueMatrixVectorMul(queue, program, config, mat.getHeight(), mat.getWidth(),
+                               cl_mat, cl_vec, cl_result_vector);
+
+        queue.enqueueReadBuffer(cl_result_vector, CL_TRUE, 0,
+                                result_vector.size() * sizeof(float), result_vector.get());
+        return result_vector;
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << std::endl;
+        throw;
+      }
+    }
+
+    // mat*vec for a sparse mat, which only reads its nonzeros
+    template<const dim_t AW, const dim_t AH, const dim_t BDIM>
+    matrix::Matrix<AH, 1> multiply(const matrix::CsrMatrix<AW, AH>& mat, const matrix::Matrix<BDIM, 1>& vec) {
+      static_assert(AW == BDIM, "width of the matrix must match the length of the vector");
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        auto& program = g_ctx.matvecProgram();
+
+        auto result_vector = matrix::zerovec<AH>();
+
+        CsrBuffers cl_mat = mat.createBuffers(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_vec = vec.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_result_vector = result_vector.createBuffer(context, CL_MEM_WRITE_ONLY);
+
+        enqueueCsrMatrixVectorMul(queue, program, AH, mat.nonZeros(),
+                                  cl_mat, cl_vec, cl_result_vector);
+
+        queue.enqueueReadBuffer(cl_result_vector, CL_TRUE, 0,
+                                result_vector.size() * sizeof(float), result_vector.get());
+        return result_vector;
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << std::endl;
+        throw;
+      }
+    }
+
+    // matA*matB for a sparse matA, which reads each nonzero once per
+    // tile of columns of matB rather than once per column
+    template<const dim_t AW, const dim_t AH, const dim_t BW, const dim_t BH>
+    matrix::Matrix<BW, AH> multiply(const matrix::CsrMatrix<AW, AH>& matA, const matrix::Matrix<BW, BH>& matB) {
+      static_assert(AW == BH, "width of A must match the height of B");
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        auto& program = g_ctx.program("sparse_kernel.cl", "");
+
+        auto result = matrix::zeromat<BW, AH>();
+
+        CsrBuffers cl_matA = matA.createBuffers(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_matB = matB.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_result = result.createBuffer(context, CL_MEM_WRITE_ONLY);
+
+        enqueueCsrMatrixMul(queue, program, AH, BW, cl_matA, cl_matB, BW, cl_result, BW);
+
+        queue.enqueueReadBuffer(cl_result, CL_TRUE, 0,
+                                result.size() * sizeof(float), result.get());
+        return result;
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << "("
+          << err.err()
+          << ")"
+          << std::endl;
+        throw;
+      }
+    }
+
+    // sample .* (matA*matB), which only computes the elements of the
+    // product at the nonzeros of sample and returns them as a sparse
+    // matrix with its pattern.  With ones in sample, the elements are
+    // those of matA*matB.
+    template<const dim_t AW, const dim_t AH, const dim_t BW, const dim_t BH>
+    matrix::CsrMatrix<BW, AH> multiply_sampled(const matrix::CsrMatrix<BW, AH>& sample,
+                                               const matrix::Matrix<AW, AH>& matA,
+                                               const matrix::Matrix<BW, BH>& matB) {
+      static_assert(AW == BH, "width of A must match the height of B");
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        auto& program = g_ctx.program("sparse_kernel.cl", "");
+
+        std::vector<float> values(sample.nonZeros());
+
+        CsrBuffers cl_sample = sample.createBuffers(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_matA = matA.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_matB = matB.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_values = createVectorBuffer(context, CL_MEM_WRITE_ONLY, values);
+
+        if (!values.empty()) {
+          enqueueCsrSampledMatrixMul(queue, program, AH, AW, values.size(), cl_sample,
+                                     cl_matA, AW, cl_matB, BW, cl_values);
+          queue.enqueueReadBuffer(cl_values, CL_TRUE, 0,
+                                  values.size() * sizeof(float), values.data());
+        }
+        return matrix::CsrMatrix<BW, AH>(sample.getRowPtr(), sample.getColIdx(), std::move(values));
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << "("
+          << err.err()
+          << ")"
+          << std::endl;
+        throw;
+      }
+    }
+
+    // The CSR form of m, built in device memory: a count of the
+    // nonzeros of each row, its scan and a copy of the nonzeros
+    template<const dim_t W, const dim_t H>
+    matrix::DeviceCsrMatrix<W, H> to_csr(const matrix::Matrix<W, H>& m) {
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        auto& program = g_ctx.program("sparse_kernel.cl", "");
+
+        cl::Buffer cl_m = m.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        std::vector<cl_int> zeros(H + 1, 0);
+        cl::Buffer rowPtr = createVectorBuffer(context, CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR, zeros);
+
+        auto count = cl::make_kernel<cl::Buffer, cl::Buffer, int, int, int>(program, "countRowNonZeros");
+        count(cl::EnqueueArgs(queue, cl::NDRange(H)), rowPtr, cl_m, W, H, W);
+        enqueueScan(queue, program, context, rowPtr, H + 1);
+
+        // The arrays of nonzeros are sized by the last row pointer
+        cl_int nonZeros;
+        queue.enqueueReadBuffer(rowPtr, CL_TRUE, sizeof(cl_int) * H, sizeof(cl_int), &nonZeros);
+
+        CsrBuffers csr{rowPtr,
+                       cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * std::max(nonZeros, 1)),
+                       cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * std::max(nonZeros, 1))};
+        auto compact = cl::make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, int, int, int>(
+          program, "compactRows");
+        compact(cl::EnqueueArgs(queue, cl::NDRange(H)), csr.colIdx, csr.values, csr.rowPtr, cl_m, W, H, W);
+        return matrix::DeviceCsrMatrix<W, H>(csr, nonZeros);
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << "("
+          << err.err()
+          << ")"
+          << std::endl;
+        throw;
+      }
+    }
+
+    // The CSR form of the W x H matrix with the entries (rowIdx[i],
+    // colIdx[i], values[i]), in any order, converted on the device.
+    // Duplicate entries are kept.
+    template<const dim_t W, const dim_t H>
+    matrix::DeviceCsrMatrix<W, H> coo_to_csr(const std::vector<cl_int>& rowIdx,
+                                             const std::vector<cl_int>& colIdx,
+                                             const std::vector<float>& values) {
+      auto outside = [](const dim_t size) {
+        return [size](const cl_int i) { return i < 0 || i >= static_cast<cl_int>(size); };
+      };
+      if (rowIdx.size() != values.size() || colIdx.size() != values.size() ||
+          std::any_of(rowIdx.begin(), rowIdx.end(), outside(H)) ||
+          std::any_of(colIdx.begin(), colIdx.end(), outside(W))) {
+        throw std::invalid_argument("inconsistent COO arrays");
+      }
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        auto& program = g_ctx.program("sparse_kernel.cl", "");
+
+        cl::Buffer cl_rowIdx = createVectorBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR, rowIdx);
+        cl::Buffer cl_colIdx = createVectorBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR, colIdx);
+        cl::Buffer cl_values = createVectorBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR, values);
+
+        CsrBuffers csr = enqueueCooToCsr(queue, program, context, H, W,
+                                         cl_rowIdx, cl_colIdx, cl_values, values.size());
+        return matrix::DeviceCsrMatrix<W, H>(csr, values.size());
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << "("
+          << err.err()
+          << ")"
+          << std::endl;
+        throw;
+      }
+    }
+
+    // The transpose of mat, on the device: its nonzeros as COO entries
+    // with rows and columns swapped, converted back to CSR
+    template<const dim_t W, const dim_t H>
+    matrix::DeviceCsrMatrix<H, W> transpose(const matrix::DeviceCsrMatrix<W, H>& mat) {
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        auto& program = g_ctx.program("sparse_kernel.cl", "");
+
+        const int nonZeros = mat.nonZeros();
+        CsrBuffers csr = mat.getBuffers();
+        cl::Buffer rowIdx(context, CL_MEM_READ_WRITE, sizeof(cl_int) * std::max(nonZeros, 1));
+        auto expand = cl::make_kernel<cl::Buffer, cl::Buffer, int>(program, "expandRows");
+        expand(cl::EnqueueArgs(queue, cl::NDRange(H)), rowIdx, csr.rowPtr, H);
+
+        CsrBuffers transposed = enqueueCooToCsr(queue, program, context, W, H,
+                                                csr.colIdx, rowIdx, csr.values, nonZeros);
+        return matrix::DeviceCsrMatrix<H, W>(transposed, nonZeros);
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << "("
+          << err.err()
+          << ")"
+          << std::endl;
+        throw;
+      }
+    }
+
+    // mat*vec for a sparse mat already in device memory
+    template<const dim_t AW, const dim_t AH, const dim_t BDIM>
+    matrix::Matrix<AH, 1> multiply(const matrix::DeviceCsrMatrix<AW, AH>& mat, const matrix::Matrix<BDIM, 1>& vec) {
+      static_assert(AW == BDIM, "width of the matrix must match the length of the vector");
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        auto& program = g_ctx.matvecProgram();
+
+        auto result_vector = matrix::zerovec<AH>();
+
+        CsrBuffers cl_mat = mat.getBuffers();
+        cl::Buffer cl_vec = vec.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_result_vector = result_vector.createBuffer(context, CL_MEM_WRITE_ONLY);
+
+        enqueueCsrMatrixVectorMul(queue, program, AH, mat.nonZeros(),
+                                  cl_mat, cl_vec, cl_result_vector);
+
+        queue.enqueueReadBuffer(cl_result_vector, CL_TRUE, 0,
+                                result_vector.size() * sizeof(float), result_vector.get());
+        return result_vector;
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << std::endl;
+        throw;
+      }
+    }
+
+    // matA*matB for a sparse matA already in device memory
+    template<const dim_t AW, const dim_t AH, const dim_t BW, const dim_t BH>
+    matrix::Matrix<BW, AH> multiply(const matrix::DeviceCsrMatrix<AW, AH>& matA, const matrix::Matrix<BW, BH>& matB) {
+      static_assert(AW == BH, "width of A must match the height of B");
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        auto& program = g_ctx.program("sparse_kernel.cl", "");
+
+        auto result = matrix::zeromat<BW, AH>();
+
+        CsrBuffers cl_matA = matA.getBuffers();
+        cl::Buffer cl_matB = matB.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_result = result.createBuffer(context, CL_MEM_WRITE_ONLY);
+
+        enqueueCsrMatrixMul(queue, program, AH, BW, cl_matA, cl_matB, BW, cl_result, BW);
+
+        queue.enqueueReadBuffer(cl_result, CL_TRUE, 0,
+                                result.size() * sizeof(float), result.get());
+        return result;
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << "("
+          << err.err()
+          << ")"
+          << std::endl;
+        throw;
+      }
+    }
+
+    // matA*matB for a block-sparse matA, which skips its zero blocks.
+    // The kernel is built with blksz set to the block size of matA.
+    template<const dim_t AW, const dim_t AH, const dim_t BW, const dim_t BH>
+    matrix::Matrix<BW, AH> multiply(const matrix::BsrMatrix<AW, AH>& matA, const matrix::Matrix<BW, BH>& matB) {
+      static_assert(AW == BH, "width of A must match the height of B");
+      const int blocksize = matA.getBlockSize();
+      if (!fitsDevice(g_ctx.device, blocksize, 1)) {
+        throw std::invalid_argument("BSR block size too large for the device");
+      }
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        const KernelConfig config{blocksize, 1, 1, blocksize};
+        auto& program = g_ctx.program("matmul_kernel.cl", config.buildOptions());
+        auto mmul = cl::make_kernel<int, int, int, float, cl::Buffer, cl::Buffer, cl::Buffer,
+                                    cl::Buffer, int, float, cl::Buffer, int,
+                                    cl::LocalSpaceArg, cl::LocalSpaceArg>(program, "mmul_bsr");
+
+        auto result = matrix::zeromat<BW, AH>();
+
+        BsrBuffers cl_matA = matA.createBuffers(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_matB = matB.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_result = result.createBuffer(context, CL_MEM_WRITE_ONLY);
+
+        mmul(
+          cl::EnqueueArgs(queue,
+                          cl::NDRange(roundUp(BW, blocksize), roundUp(AH, blocksize)),
+                          cl::NDRange(blocksize, blocksize)),
+          AH, BW, AW, 1.0f,
+          cl_matA.blockRowPtr, cl_matA.blockCol, cl_matA.blocks,
+          cl_matB, BW,
+          0.0f, cl_result, BW,
+          cl::Local(sizeof(float) * blocksize*blocksize),
+          cl::Local(sizeof(float) * blocksize*blocksize));
+
+        queue.enqueueReadBuffer(cl_result, CL_TRUE, 0,
+                                result.size() * sizeof(float), result.get());
+        return result;
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << "("
+          << err.err()
+          << ")"
+          << std::endl;
+        throw;
+      }
+    }
+
+    // mat*vec for a sparse mat in SELL-C-sigma form
+    template<const dim_t AW, const dim_t AH, const dim_t BDIM>
+    matrix::Matrix<AH, 1> multiply(const matrix::SellMatrix<AW, AH>& mat, const matrix::Matrix<BDIM, 1>& vec) {
+      static_assert(AW == BDIM, "width of the matrix must match the length of the vector");
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        auto& program = g_ctx.matvecProgram();
+
+        auto result_vector = matrix::zerovec<AH>();
+
+        SellBuffers cl_mat = mat.createBuffers(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_vec = vec.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_result_vector = result_vector.createBuffer(context, CL_MEM_WRITE_ONLY);
+
+        enqueueSellMatrixVectorMul(queue, program, AH, mat.getChunk(),
+                                   cl_mat, cl_vec, cl_result_vector);
+
+        queue.enqueueReadBuffer(cl_result_vector, CL_TRUE, 0,
+                                result_vector.size() * sizeof(float), result_vector.get());
+        return result_vector;
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << std::endl;
+        throw;
+      }
+    }
+
+    // A^T*vec for an AW x AH matrix A already in device memory, such as
+    // a buffer made once with Matrix::createBuffer on g_ctx.context, so
+    // that A is not uploaded again for every product.  A is read from its
+    // stored layout and needs no transposed copy; call it as
+    // multiply_transposed<AW>(buffer, vec).
+    template<const dim_t AW, const dim_t AH>
+    matrix::Matrix<AW, 1> multiply_transposed(cl::Buffer& mat, const matrix::Matrix<AH, 1>& vec) {
+      if (mat.getInfo<CL_MEM_SIZE>() < sizeof(float) * AW*AH) {
+        throw std::invalid_argument("buffer too small for an AW x AH matrix");
+      }
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        const KernelConfig config = g_ctx.config("mv", AH);
+        auto& program = g_ctx.program("matvec_mul.cl", config.buildOptions());
+
+        auto result_vector = matrix::zerovec<AW>();
+
+        cl::Buffer cl_vec = vec.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_result_vector = result_vector.createBuffer(context, CL_MEM_WRITE_ONLY);
+
+        enqueueMatrixTransposeVectorMul(queue, program, context, AH, AW,
+                                        mat, cl_vec, cl_result_vector);
+
+        queue.enqueueReadBuffer(cl_result_vector, CL_TRUE, 0,
+                                result_vector.size() * sizeof(float), result_vector.get());
+        return result_vector;
+      } catch (cl::Error err) {
+        std::cout << "Exception\n";
+        std::cerr
+          << "ERROR: "
+          << err.what()
+          << std::endl;
+        throw;
+      }
+    }
+
+    // A^T*vec, with A read from its stored layout, so that it needs no
+    // transposed copy on the host or the device
+    template<const dim_t AW, const dim_t AH>
+    matrix::Matrix<AW, 1> multiply_transposed(const matrix::Matrix<AW, AH>& mat, const matrix::Matrix<AH, 1>& vec) {
+      cl::Buffer cl_mat = mat.createBuffer(g_ctx.context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+      return multiply_transposed<AW>(cl_mat, vec);
+    }
+
+    // Matrix-vector product in double precision, on devices that support
+    // cl_khr_fp64
+    template<const dim_t AW, const dim_t AH, const dim_t BDIM>
+    matrix::Matrix<AH, 1, double> multiply(const matrix::Matrix<AW, AH, double>& mat,
+                                           const matrix::Matrix<BDIM, 1, double>& vec) {
+      static_assert(AW == BDIM, "width of the matrix must match the length of the vector");
+      if (!g_ctx.fp64) {
+        throw std::runtime_error("double precision needs a device with cl_khr_fp64");
+      }
+      try {
+        auto& context = g_ctx.context;
+        auto& queue = g_ctx.queue;
+        // Only the work-group size applies to matrixVectorMul_f64
+        const KernelConfig config = g_ctx.config("mv", AW);
+        const int groupsize = (config.blocksize && AH % config.blocksize == 0) ? config.blocksize : 0;
+        auto& program = g_ctx.program("matvec_mul.cl", config.buildOptions());
+        auto mv = cl::make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, int>(program, "matrixVectorMul_f64");
+
+        auto result_vector = matrix::zerovec<AH, double>();
+
+        cl::Buffer cl_mat = mat.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_vec = vec.createBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR);
+        cl::Buffer cl_result_vector = result_vector.createBuffer(context, CL_MEM_WRITE_ONLY);
+
+        mv(
+          cl::EnqueueArgs(queue, cl::NDRange(AH),
+                          groupsize ? cl::NDRange(groupsize) : cl::NullRange),
           cl_result_vector,
           cl_mat,
           cl_vec,
-          mat.getWidth()
+          AW
           );
 
-        queue.enqueueReadBuffer(cl_result_vector, CL_TRUE, 0, mat.getWidth() * sizeof(float), result_vector.get());
-        result_vector.print();
+        queue.enqueueReadBuffer(cl_result_vector, CL_TRUE, 0,
+                                result_vector.size() * sizeof(double), result_vector.get());
         return result_vector;
       } catch (cl::Error err) {
         std::cout << "Exception\n";
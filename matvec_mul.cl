@@ -1,12 +1,376 @@
+// Vector width and unroll factor of the dot product loop, set by the
+// host with -Dvw=N and -Dkunroll=N.  width must be a multiple of vw,
+// which may be 1, 2 or 4.
+#ifndef vw
+#define vw 1
+#endif
+
+#ifndef kunroll
+#define kunroll 1
+#endif
+
+#define PRAGMA(x) _Pragma(#x)
+#define UNROLL(n) PRAGMA(unroll n)
+#define CAT_(a, b) a##b
+#define CAT(a, b) CAT_(a, b)
+
+// Number of right-hand sides of matrixVectorMulBlock, set with
+// -Dnvec=N
+#ifndef nvec
+#define nvec 1
+#endif
+
+// Address space of the vector of matrixVectorMul.  The host sets
+// -Dxspace=__constant when the vector fits in constant memory, where
+// every work-item reading the same element at once is a broadcast.
+#ifndef xspace
+#define xspace __global
+#endif
+
+#if vw == 1
+#define floatv float
+#define vloadv(offset, p) ((p)[offset])
+#else
+#define floatv CAT(float, vw)
+#define vloadv CAT(vload, vw)
+#endif
+
 __kernel void matrixVectorMul(__global float* resultVector,
 			      __global float* matrixA,
-			      __global float* vectorB,
+			      xspace float* vectorB,
 			      const int width)
 {
   int tx = get_global_id(0);
-  float value = 0;
+  __global const float* row = matrixA + tx * width;
+  floatv value = 0;
+  UNROLL(kunroll)
+  for (unsigned int k = 0; k < width / vw; ++k) {
+    value += vloadv(k, row) * vloadv(k, vectorB);
+  }
+  resultVector[tx] = dot(value, (floatv)(1.0f));
+}
+
+// matrixVectorMul for vectors too long for constant memory.  The
+// work-group copies the vector into local memory a chunk at a time,
+// get_local_size(0)*vw floats long, so each element of it is read
+// from global memory once per work-group rather than once per row.
+// The NDRange may round the rows up.
+__kernel void matrixVectorMulLocal(__global float* resultVector,
+				   __global float* matrixA,
+				   __global float* vectorB,
+				   const int width,
+				   const int rows,
+				   __local float* chunkB)
+{
+  const int tx = get_global_id(0);
+  const int lid = get_local_id(0);
+  const int lsize = get_local_size(0);
+  const int chunk = lsize * vw;
+  __global const float* row = matrixA + tx * width;
+  floatv value = 0;
+  for (int base = 0; base < width; base += chunk) {
+    const int n = min(chunk, width - base);
+    for (int k = lid; k < n; k += lsize) {
+      chunkB[k] = vectorB[base + k];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (tx < rows) {
+      UNROLL(kunroll)
+      for (int k = 0; k < n / vw; ++k) {
+        value += vloadv(k, row + base) * vloadv(k, chunkB);
+      }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+  if (tx < rows) {
+    resultVector[tx] = dot(value, (floatv)(1.0f));
+  }
+}
+
+// One row for every get_local_size(0) work-items, which read it
+// together: neighbouring work-items read neighbouring elements (or
+// vw-wide vectors), so their loads coalesce, where a work-item per
+// row reads addresses width floats apart.  The vector goes through
+// local memory in chunks, as in matrixVectorMulLocal, so the rows of
+// a work-group share each read of it.  The partial sums meet in
+// local memory and a tree reduction adds them up.  A work-group
+// takes get_local_size(1) rows, and get_local_size(0) must be a
+// power of two.  chunkB holds vw floats per work-item.  The NDRange
+// may round the rows up.
+__kernel void matrixVectorMulRow(__global float* resultVector,
+				 __global float* matrixA,
+				 __global float* vectorB,
+				 const int width,
+				 const int rows,
+				 __local float* partial,
+				 __local float* chunkB)
+{
+  const int lane = get_local_id(0);
+  const int lanes = get_local_size(0);
+  const int row = get_global_id(1);
+  const int base = get_local_id(1) * lanes;
+  const int lid = base + lane;
+  const int lsize = lanes * get_local_size(1);
+  const int chunk = lsize * vw;
+
+  __global const float* rowA = matrixA + row * width;
+  floatv value = 0;
+  for (int first = 0; first < width; first += chunk) {
+    const int n = min(chunk, width - first);
+    for (int k = lid; k < n; k += lsize) {
+      chunkB[k] = vectorB[first + k];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (row < rows) {
+      UNROLL(kunroll)
+      for (int k = lane; k < n / vw; k += lanes) {
+        value += vloadv(k, rowA + first) * vloadv(k, chunkB);
+      }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+  partial[base + lane] = dot(value, (floatv)(1.0f));
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (int offset = lanes / 2; offset > 0; offset /= 2) {
+    if (lane < offset) {
+      partial[base + lane] += partial[base + lane + offset];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (lane == 0 && row < rows) {
+    resultVector[row] = partial[base];
+  }
+}
+
+// Products with nvec vectors at once: B is width x nvec and the
+// result rows x nvec, both row-major.  Rows are shared between
+// work-items as in matrixVectorMulRow, and each element of A is
+// applied to all nvec vectors as soon as it is read, so A is read
+// once instead of once per vector.  B goes through local memory a
+// work-group's worth of its rows at a time; chunkB, like partial,
+// holds nvec floats per work-item.
+__kernel void matrixVectorMulBlock(__global float* result,
+				   __global float* matrixA,
+				   __global float* vectorsB,
+				   const int width,
+				   const int rows,
+				   __local float* partial,
+				   __local float* chunkB)
+{
+  const int lane = get_local_id(0);
+  const int lanes = get_local_size(0);
+  const int row = get_global_id(1);
+  const int base = get_local_id(1) * lanes;
+  const int lid = base + lane;
+  const int lsize = lanes * get_local_size(1);
+
+  float value[nvec];
+  UNROLL(nvec)
+  for (int v = 0; v < nvec; ++v) {
+    value[v] = 0.0f;
+  }
+  __global const float* rowA = matrixA + row * width;
+  for (int first = 0; first < width; first += lsize) {
+    const int n = min(lsize, width - first);
+    for (int k = lid; k < n * nvec; k += lsize) {
+      chunkB[k] = vectorsB[first * nvec + k];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (row < rows) {
+      UNROLL(kunroll)
+      for (int k = lane; k < n; k += lanes) {
+        const float a = rowA[first + k];
+        UNROLL(nvec)
+        for (int v = 0; v < nvec; ++v) {
+          value[v] += a * chunkB[k * nvec + v];
+        }
+      }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+  UNROLL(nvec)
+  for (int v = 0; v < nvec; ++v) {
+    partial[(base + lane) * nvec + v] = value[v];
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (int offset = lanes / 2; offset > 0; offset /= 2) {
+    if (lane < offset) {
+      UNROLL(nvec)
+      for (int v = 0; v < nvec; ++v) {
+        partial[(base + lane) * nvec + v] += partial[(base + lane + offset) * nvec + v];
+      }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (lane == 0 && row < rows) {
+    UNROLL(nvec)
+    for (int v = 0; v < nvec; ++v) {
+      result[row * nvec + v] = partial[base * nvec + v];
+    }
+  }
+}
+
+// Sparse matrix times vector for a matrix in CSR form: the nonzeros
+// of row r are values[rowPtr[r]] to values[rowPtr[r+1]-1], in the
+// columns given by colIdx.  One work-item per row, which suits rows
+// with only a few nonzeros.
+__kernel void csrMatrixVectorMul(__global float* resultVector,
+				 __global const int* rowPtr,
+				 __global const int* colIdx,
+				 __global const float* values,
+				 __global const float* vectorB,
+				 const int rows)
+{
+  const int row = get_global_id(0);
+  if (row >= rows) {
+    return;
+  }
+
+  float value = 0.0f;
+  for (int j = rowPtr[row]; j < rowPtr[row + 1]; ++j) {
+    value += values[j] * vectorB[colIdx[j]];
+  }
+  resultVector[row] = value;
+}
+
+// csrMatrixVectorMul with get_local_size(0) work-items per row, as in
+// matrixVectorMulRow, for rows with many nonzeros: the work-items
+// read consecutive nonzeros of the row together and reduce their
+// partial sums in local memory.
+__kernel void csrMatrixVectorMulRow(__global float* resultVector,
+				    __global const int* rowPtr,
+				    __global const int* colIdx,
+				    __global const float* values,
+				    __global const float* vectorB,
+				    const int rows,
+				    __local float* partial)
+{
+  const int lane = get_local_id(0);
+  const int lanes = get_local_size(0);
+  const int row = get_global_id(1);
+  const int base = get_local_id(1) * lanes;
+
+  float value = 0.0f;
+  if (row < rows) {
+    for (int j = rowPtr[row] + lane; j < rowPtr[row + 1]; j += lanes) {
+      value += values[j] * vectorB[colIdx[j]];
+    }
+  }
+  partial[base + lane] = value;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (int offset = lanes / 2; offset > 0; offset /= 2) {
+    if (lane < offset) {
+      partial[base + lane] += partial[base + lane + offset];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (lane == 0 && row < rows) {
+    resultVector[row] = partial[base];
+  }
+}
+
+// resultVector = A * vectorB for a sparse A in SELL-C-sigma form
+// (see SellMatrix in matrix.hpp): work-item i computes the i'th row in
+// sorted order, with chunk rows per slice.  The lanes of a slice step
+// through their rows together, so each step reads chunk consecutive
+// elements of colIdx and values, and only the padding of the slice is
+// wasted work.  The NDRange may round the rows up.
+__kernel void sellMatrixVectorMul(__global float* resultVector,
+				  __global const int* sliceStart,
+				  __global const int* colIdx,
+				  __global const float* values,
+				  __global const int* rowPerm,
+				  __global const float* vectorB,
+				  const int rows,
+				  const int chunk)
+{
+  const int i = get_global_id(0);
+  if (i >= rows) {
+    return;
+  }
+  const int slice = i / chunk;
+
+  float value = 0.0f;
+  for (int j = sliceStart[slice] + i % chunk; j < sliceStart[slice + 1]; j += chunk) {
+    value += values[j] * vectorB[colIdx[j]];
+  }
+  resultVector[rowPerm[i]] = value;
+}
+
+// result = A^T * vectorB for a rows x width matrix A, read as it is
+// stored.  Work-item (col, slab) sums column col over the slab'th
+// chunk of rows, so the work-items of a work-group read neighbouring
+// elements of each row.  Each slab leaves one partial sum per
+// column, width floats apart in partial; reduceColumns adds them up.
+// The NDRange may round the columns up.
+__kernel void matrixTransposeVectorMul(__global float* partial,
+				       __global float* matrixA,
+				       __global float* vectorB,
+				       const int width,
+				       const int rows,
+				       const int chunk)
+{
+  const int col = get_global_id(0);
+  const int slab = get_global_id(1);
+  if (col >= width) {
+    return;
+  }
+
+  const int first = slab * chunk;
+  const int last = min(first + chunk, rows);
+  float value = 0.0f;
+  UNROLL(kunroll)
+  for (int i = first; i < last; ++i) {
+    value += matrixA[i * width + col] * vectorB[i];
+  }
+  partial[slab * width + col] = value;
+}
+
+// Sums the slabs partial sums of each column left by
+// matrixTransposeVectorMul
+__kernel void reduceColumns(__global float* resultVector,
+			    __global float* partial,
+			    const int width,
+			    const int slabs)
+{
+  const int col = get_global_id(0);
+  if (col >= width) {
+    return;
+  }
+
+  float value = 0.0f;
+  for (int slab = 0; slab < slabs; ++slab) {
+    value += partial[slab * width + col];
+  }
+  resultVector[col] = value;
+}
+
+// Double precision matrixVectorMul, compiled only for devices that
+// support cl_khr_fp64
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+
+__kernel void matrixVectorMul_f64(__global double* resultVector,
+				  __global double* matrixA,
+				  __global double* vectorB,
+				  const int width)
+{
+  int tx = get_global_id(0);
+  __global const double* row = matrixA + tx * width;
+  double value = 0.0;
+  UNROLL(kunroll)
   for (unsigned int k = 0; k < width; ++k) {
-    value += matrixA[tx * width + k] * vectorB[k];
+    value += row[k] * vectorB[k];
   }
   resultVector[tx] = value;
 }
+#endif
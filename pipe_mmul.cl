@@ -0,0 +1,191 @@
+//-------------------------------------------------------------
+//
+//  PROGRAM: Pipelined Matrix Multiplication kernels
+//
+//  PURPOSE: Computes the product matrix
+//
+//              C = alpha * A * B + beta * C
+//
+//           with three single work-item kernels that run at the
+//           same time and stream blocks to each other:
+//
+//              mmul_reader  --A, B-->  mmul_compute  --C-->  mmul_writer
+//
+//           The reader is the only kernel that reads global
+//           memory and the writer the only one that writes it,
+//           so on a dataflow device the DDR traffic overlaps the
+//           arithmetic instead of stalling it.
+//
+//           C is computed one blksz x blksz block at a time.  For
+//           each block the reader sends the blocks of A and B
+//           along K, row by row, and the compute kernel sends
+//           back the finished block of C.  Blocks are padded with
+//           zeros past the edges of the matrices.
+//
+//  USAGE:   The kernels are connected by OpenCL 2.0 pipes, so the
+//           program must be built with -cl-std=CL2.0, or by Intel
+//           FPGA channels when built with -Duse_channels.  Each
+//           kernel is launched as a task on a queue of its own;
+//           a runtime that runs them one after another instead
+//           will wait forever once a pipe fills up.
+//
+//-------------------------------------------------------------
+
+#ifndef blksz
+#define blksz 16
+#endif
+
+// Capacity of each channel in floats.  With pipes the host sets
+// the capacity when it creates them.
+#ifndef pipe_depth
+#define pipe_depth (2*blksz*blksz)
+#endif
+
+#define PRAGMA(x) _Pragma(#x)
+#define UNROLL(n) PRAGMA(unroll n)
+
+// Channels are global and block when full or empty; pipes are
+// kernel arguments and report it instead, so they are polled
+#ifdef use_channels
+#pragma OPENCL EXTENSION cl_intel_channels : enable
+
+channel float pipe_a __attribute__((depth(pipe_depth)));
+channel float pipe_b __attribute__((depth(pipe_depth)));
+channel float pipe_c __attribute__((depth(pipe_depth)));
+
+#define PIPE_IN(p)
+#define PIPE_OUT(p)
+#define PIPE_READ(p, v) ((v) = read_channel_intel(p))
+#define PIPE_WRITE(p, v) write_channel_intel(p, v)
+#define SINGLE_TASK __attribute__((max_global_work_dim(0)))
+#else
+#define PIPE_IN(p) , __read_only pipe float p
+#define PIPE_OUT(p) , __write_only pipe float p
+#define PIPE_READ(p, v) while (read_pipe(p, &(v)) != 0)
+#define PIPE_WRITE(p, v) while (write_pipe(p, &(v)) != 0)
+#define SINGLE_TASK
+#endif
+
+__kernel SINGLE_TASK
+void mmul_reader(
+                const int                      M,
+                const int                      N,
+                const int                      K,
+                __global const float* restrict A,
+                const int                      lda,
+                __global const float* restrict B,
+                const int                      ldb
+                PIPE_OUT(pipe_a)
+                PIPE_OUT(pipe_b))
+{
+    for (int Jblk = 0; Jblk < M; Jblk += blksz)
+    {
+       for (int Iblk = 0; Iblk < N; Iblk += blksz)
+       {
+          for (int Kblk = 0; Kblk < K; Kblk += blksz)
+          {
+             for (int r = 0; r < blksz; r++)
+             {
+                for (int k = 0; k < blksz; k++)
+                {
+                   float a = (Jblk+r < M && Kblk+k < K) ?
+                      A[(Jblk+r)*lda+Kblk+k] : 0.0f;
+                   PIPE_WRITE(pipe_a, a);
+                }
+             }
+             for (int k = 0; k < blksz; k++)
+             {
+                for (int c = 0; c < blksz; c++)
+                {
+                   float b = (Kblk+k < K && Iblk+c < N) ?
+                      B[(Kblk+k)*ldb+Iblk+c] : 0.0f;
+                   PIPE_WRITE(pipe_b, b);
+                }
+             }
+          }
+       }
+    }
+}
+
+__kernel SINGLE_TASK
+void mmul_compute(
+                const int M,
+                const int N,
+                const int K
+                PIPE_IN(pipe_a)
+                PIPE_IN(pipe_b)
+                PIPE_OUT(pipe_c))
+{
+    float Awrk[blksz][blksz];
+    float Bwrk[blksz][blksz];
+    float Cwrk[blksz][blksz];
+
+    const int Num_BLK = (K+blksz-1)/blksz;
+    const int blocks = ((M+blksz-1)/blksz) * ((N+blksz-1)/blksz);
+
+    for (int blk = 0; blk < blocks; blk++)
+    {
+       for (int r = 0; r < blksz; r++)
+          for (int c = 0; c < blksz; c++)
+             Cwrk[r][c] = 0.0f;
+
+       for (int Kblk = 0; Kblk < Num_BLK; Kblk++)
+       {
+          for (int r = 0; r < blksz; r++)
+             for (int k = 0; k < blksz; k++)
+                PIPE_READ(pipe_a, Awrk[r][k]);
+          for (int k = 0; k < blksz; k++)
+             for (int c = 0; c < blksz; c++)
+                PIPE_READ(pipe_b, Bwrk[k][c]);
+
+          for (int r = 0; r < blksz; r++)
+          {
+             for (int c = 0; c < blksz; c++)
+             {
+                float sum = Cwrk[r][c];
+                UNROLL(blksz)
+                for (int k = 0; k < blksz; k++)
+                   sum += Awrk[r][k] * Bwrk[k][c];
+                Cwrk[r][c] = sum;
+             }
+          }
+       }
+
+       for (int r = 0; r < blksz; r++)
+          for (int c = 0; c < blksz; c++)
+             PIPE_WRITE(pipe_c, Cwrk[r][c]);
+    }
+}
+
+__kernel SINGLE_TASK
+void mmul_writer(
+                const int                      M,
+                const int                      N,
+                const float                    alpha,
+                const float                    beta,
+                __global       float* restrict C,
+                const int                      ldc
+                PIPE_IN(pipe_c))
+{
+    for (int Jblk = 0; Jblk < M; Jblk += blksz)
+    {
+       for (int Iblk = 0; Iblk < N; Iblk += blksz)
+       {
+          for (int r = 0; r < blksz; r++)
+          {
+             for (int c = 0; c < blksz; c++)
+             {
+                float value;
+                PIPE_READ(pipe_c, value);
+                if (Jblk+r < M && Iblk+c < N)
+                {
+                   float result = alpha*value;
+                   if (beta != 0.0f)
+                      result += beta*C[(Jblk+r)*ldc+Iblk+c];
+                   C[(Jblk+r)*ldc+Iblk+c] = result;
+                }
+             }
+          }
+       }
+    }
+}
@@ -0,0 +1,299 @@
+//-------------------------------------------------------------
+//
+//  PROGRAM: Sparse matrix kernels
+//
+//  PURPOSE: Products involving sparse matrices in compressed
+//           sparse row (CSR) form, see CsrMatrix in matrix.hpp:
+//
+//              csrMatrixMul         C = A * B, A sparse
+//              csrSampledMatrixMul  C = S .* (A * B), S sparse
+//
+//           and conversions that build CSR matrices in device
+//           memory:
+//
+//              dense to CSR   countRowNonZeros, scan, compactRows
+//              COO to CSR     makeSortKeys, bitonicSortStep,
+//                             gatherSorted, countEntries, scan
+//              CSR transpose  expandRows, then COO to CSR
+//
+//           where scan is scanBlocks followed by addBlockSums.
+//           The sparse matrix-vector products are in
+//           matvec_mul.cl.
+//
+//-------------------------------------------------------------
+
+// C = A * B for an M x K sparse A and a K x N dense B.  A work-group
+// computes a tile of get_local_size(0) columns of one row of C, a
+// work-item per column.  The work-items copy the nonzeros of the row
+// to local memory, as many at a time as there are work-items, and
+// then each one multiplies all of them by its own column of B, so a
+// nonzero is read from global memory once per tile instead of once
+// per column.  The rows of B that a nonzero picks are read by the
+// work-items side by side.  The NDRange may round the columns up.
+__kernel void csrMatrixMul(
+                const int                      M,
+                const int                      N,
+                __global const int*   restrict rowPtr,
+                __global const int*   restrict colIdx,
+                __global const float* restrict values,
+                __global const float* restrict B,
+                const int                      ldb,
+                __global       float* restrict C,
+                const int                      ldc,
+                __local        int*   restrict tileCols,
+                __local        float* restrict tileValues)
+{
+    const int lane = get_local_id(0);
+    const int lanes = get_local_size(0);
+    const int col = get_global_id(0);
+    const int row = get_global_id(1);
+
+    const int start = rowPtr[row];
+    const int end = rowPtr[row+1];
+
+    float sum = 0.0f;
+    for (int first = start; first < end; first += lanes)
+    {
+       if (first+lane < end)
+       {
+          tileCols[lane] = colIdx[first+lane];
+          tileValues[lane] = values[first+lane];
+       }
+       barrier(CLK_LOCAL_MEM_FENCE);
+
+       if (col < N)
+       {
+          const int count = min(lanes, end-first);
+          for (int k = 0; k < count; k++)
+             sum += tileValues[k] * B[tileCols[k]*ldb+col];
+       }
+       barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (col < N)
+       C[row*ldc+col] = sum;
+}
+
+// The values of C = S .* (A * B), the product of an M x K dense A and
+// a K x N dense B sampled at the nonzeros of the sparse M x N S: C has
+// the nonzero pattern of S, and its nonzero n, in row r and column
+// colIdx[n], is S's nonzero times the dot product of row r of A and
+// that column of B.  Use ones in S to just pick out elements of A*B.
+// No other element of A*B is computed.
+//
+// get_local_size(0) work-items share a row of S and take its nonzeros
+// in turn, so they read the row of A together and neighbouring
+// columns of B.  The NDRange may round the rows up.
+__kernel void csrSampledMatrixMul(
+                const int                      M,
+                const int                      K,
+                __global const int*   restrict rowPtr,
+                __global const int*   restrict colIdx,
+                __global const float* restrict sample,
+                __global const float* restrict A,
+                const int                      lda,
+                __global const float* restrict B,
+                const int                      ldb,
+                __global       float* restrict values)
+{
+    const int lane = get_local_id(0);
+    const int lanes = get_local_size(0);
+    const int row = get_global_id(1);
+    if (row >= M)
+       return;
+
+    for (int n = rowPtr[row]+lane; n < rowPtr[row+1]; n += lanes)
+    {
+       const int col = colIdx[n];
+       float sum = 0.0f;
+       for (int k = 0; k < K; k++)
+          sum += A[row*lda+k] * B[k*ldb+col];
+       values[n] = sample[n] * sum;
+    }
+}
+
+//-------------------------------------------------------------
+//  Format conversion
+//-------------------------------------------------------------
+
+// Inclusive prefix sum of each work-group's elements of data, in
+// place, with the total of work-group g left in sums[g].  Adding
+// the prefix sums of sums back with addBlockSums completes the scan
+// of data.  The NDRange may round n up.
+__kernel void scanBlocks(
+                __global       int* restrict data,
+                const int                    n,
+                __global       int* restrict sums,
+                __local        int* restrict partial)
+{
+    const int i = get_global_id(0);
+    const int lid = get_local_id(0);
+    const int size = get_local_size(0);
+
+    partial[lid] = i < n ? data[i] : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int offset = 1; offset < size; offset *= 2)
+    {
+       const int add = lid >= offset ? partial[lid-offset] : 0;
+       barrier(CLK_LOCAL_MEM_FENCE);
+       partial[lid] += add;
+       barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (i < n)
+       data[i] = partial[lid];
+    if (lid == size-1)
+       sums[get_group_id(0)] = partial[lid];
+}
+
+// Adds the scanned totals of the work-groups before it to each
+// element of data, with the work-groups of scanBlocks
+__kernel void addBlockSums(
+                __global       int* restrict data,
+                const int                    n,
+                __global const int* restrict sums)
+{
+    const int i = get_global_id(0);
+    const int group = get_group_id(0);
+    if (group > 0 && i < n)
+       data[i] += sums[group-1];
+}
+
+// counts[index[i]+1] += 1 for each of the n indices, on zeroed
+// counts, so that scanning counts gives the row pointers of a CSR
+// matrix whose nonzero i is in row index[i]
+__kernel void countEntries(
+                __global       int* restrict counts,
+                __global const int* restrict index,
+                const int                    n)
+{
+    const int i = get_global_id(0);
+    if (i < n)
+       atomic_inc(&counts[index[i]+1]);
+}
+
+// counts[row+1] = the number of nonzeros of each row of the M x N
+// dense A, as countEntries leaves them
+__kernel void countRowNonZeros(
+                __global       int*   restrict counts,
+                __global const float* restrict A,
+                const int                      lda,
+                const int                      M,
+                const int                      N)
+{
+    const int row = get_global_id(0);
+    if (row >= M)
+       return;
+
+    int count = 0;
+    for (int col = 0; col < N; col++)
+       count += A[row*lda+col] != 0.0f;
+    counts[row+1] = count;
+}
+
+// Copies the nonzeros of each row of the M x N dense A to the CSR
+// arrays, at the positions given by the scanned counts
+__kernel void compactRows(
+                __global       int*   restrict colIdx,
+                __global       float* restrict values,
+                __global const int*   restrict rowPtr,
+                __global const float* restrict A,
+                const int                      lda,
+                const int                      M,
+                const int                      N)
+{
+    const int row = get_global_id(0);
+    if (row >= M)
+       return;
+
+    int n = rowPtr[row];
+    for (int col = 0; col < N; col++)
+    {
+       const float value = A[row*lda+col];
+       if (value != 0.0f)
+       {
+          colIdx[n] = col;
+          values[n] = value;
+          n++;
+       }
+    }
+}
+
+// rowIdx[n] = the row of nonzero n of a CSR matrix, its COO form
+__kernel void expandRows(
+                __global       int* restrict rowIdx,
+                __global const int* restrict rowPtr,
+                const int                    rows)
+{
+    const int row = get_global_id(0);
+    if (row >= rows)
+       return;
+
+    for (int n = rowPtr[row]; n < rowPtr[row+1]; n++)
+       rowIdx[n] = row;
+}
+
+// Sort keys of n COO entries, which order them by row and then by
+// column, and the identity permutation that bitonicSortStep carries
+// along.  The NDRange is a power of two; the keys past n sort last.
+__kernel void makeSortKeys(
+                __global       ulong* restrict keys,
+                __global       int*   restrict perm,
+                __global const int*   restrict rowIdx,
+                __global const int*   restrict colIdx,
+                const int                      n,
+                const int                      width)
+{
+    const int i = get_global_id(0);
+    keys[i] = i < n ? (ulong)rowIdx[i]*width + colIdx[i] : ULONG_MAX;
+    perm[i] = i;
+}
+
+// One compare-exchange step of a bitonic sort of keys, and of perm
+// with them: k is the size of the sequences being merged and j the
+// distance between the elements compared.  The host runs the steps
+// for k = 2, 4, ... up to the power-of-two NDRange and, for each k,
+// j = k/2, k/4, ... down to 1.
+__kernel void bitonicSortStep(
+                __global       ulong* restrict keys,
+                __global       int*   restrict perm,
+                const int                      j,
+                const int                      k)
+{
+    const int i = get_global_id(0);
+    const int partner = i ^ j;
+    if (partner <= i)
+       return;
+
+    const ulong a = keys[i];
+    const ulong b = keys[partner];
+    const bool ascending = (i & k) == 0;
+    if ((a > b) == ascending)
+    {
+       keys[i] = b;
+       keys[partner] = a;
+       const int p = perm[i];
+       perm[i] = perm[partner];
+       perm[partner] = p;
+    }
+}
+
+// The column indices and values of n COO entries in the order that
+// sorting their keys left them in
+__kernel void gatherSorted(
+                __global       int*   restrict colIdx,
+                __global       float* restrict values,
+                __global const ulong* restrict keys,
+                __global const int*   restrict perm,
+                __global const float* restrict cooValues,
+                const int                      n,
+                const int                      width)
+{
+    const int i = get_global_id(0);
+    if (i >= n)
+       return;
+
+    colIdx[i] = keys[i] % width;
+    values[i] = cooValues[perm[i]];
+}
@@ -0,0 +1,151 @@
+//-------------------------------------------------------------
+//
+//  PROGRAM: Systolic Matrix Multiplication kernel
+//
+//  PURPOSE: Computes the product matrix
+//
+//              C = alpha * A * B + beta * C
+//
+//           with a single work-item that models a systolic
+//           array of pe_rows x pe_cols processing elements, for
+//           FPGAs.  An NDRange kernel like mmul spends most of
+//           an FPGA on work-item scheduling and local memory
+//           arbitration; a single work-item loop is pipelined
+//           by the compiler instead, and the fully unrolled PE
+//           array becomes a grid of multiply-adds wired to their
+//           neighbours.
+//
+//           C is computed one pe_rows x pe_cols tile at a time.
+//           Row r of the tile of A enters the array from the
+//           left, delayed by r steps, and column c of the tile
+//           of B enters from the top, delayed by c steps.  Every
+//           step each PE passes its A value to the right and its
+//           B value down, and adds their product to its own
+//           element of C.  The skew makes A(r,k) and B(k,c) meet
+//           in PE (r,c) on step k+r+c.
+//
+//           The A and B registers are shift registers that the
+//           compiler turns into plain flip-flops; nothing in the
+//           array goes through memory.
+//
+//  USAGE:   Build with -Dpe_rows=N -Dpe_cols=N and launch as a
+//           task (global and local size 1).  The Intel FPGA
+//           emulator and pocl both run it as ordinary C, which
+//           is how it is checked without a board.
+//
+//-------------------------------------------------------------
+
+#ifndef pe_rows
+#define pe_rows 8
+#endif
+
+#ifndef pe_cols
+#define pe_cols 8
+#endif
+
+#define PRAGMA(x) _Pragma(#x)
+#define UNROLL(n) PRAGMA(unroll n)
+
+// Tells the Intel FPGA compiler that there is no NDRange to build
+#ifdef INTELFPGA_CL
+#define SINGLE_TASK __attribute__((max_global_work_dim(0)))
+#else
+#define SINGLE_TASK
+#endif
+
+__kernel SINGLE_TASK __attribute__((reqd_work_group_size(1, 1, 1)))
+void mmul_systolic(
+                const int                      M,
+                const int                      N,
+                const int                      K,
+                const float                    alpha,
+                __global const float* restrict A,
+                const int                      lda,
+                __global const float* restrict B,
+                const int                      ldb,
+                const float                    beta,
+                __global       float* restrict C,
+                const int                      ldc)
+{
+    // Skewing adds pe_rows+pe_cols-2 steps to fill and drain the array
+    const int steps = K + pe_rows + pe_cols - 2;
+
+    for (int Jblk = 0; Jblk < M; Jblk += pe_rows)
+    {
+       for (int Iblk = 0; Iblk < N; Iblk += pe_cols)
+       {
+          float acc[pe_rows][pe_cols];
+          float a_reg[pe_rows][pe_cols];
+          float b_reg[pe_rows][pe_cols];
+
+          UNROLL(pe_rows)
+          for (int r = 0; r < pe_rows; r++)
+          {
+             UNROLL(pe_cols)
+             for (int c = 0; c < pe_cols; c++)
+             {
+                acc[r][c] = 0.0f;
+                a_reg[r][c] = 0.0f;
+                b_reg[r][c] = 0.0f;
+             }
+          }
+
+          for (int t = 0; t < steps; t++)
+          {
+             // Shift, from the far corner back so that every value
+             // moves one PE per step.  The PEs on the edges take the
+             // skewed inputs, zero outside of A and B.
+             UNROLL(pe_rows)
+             for (int r = pe_rows-1; r >= 0; r--)
+             {
+                UNROLL(pe_cols)
+                for (int c = pe_cols-1; c >= 0; c--)
+                {
+                   if (c > 0)
+                      a_reg[r][c] = a_reg[r][c-1];
+                   else
+                   {
+                      const int k = t - r;
+                      a_reg[r][0] = (Jblk+r < M && k >= 0 && k < K) ?
+                         A[(Jblk+r)*lda+k] : 0.0f;
+                   }
+
+                   if (r > 0)
+                      b_reg[r][c] = b_reg[r-1][c];
+                   else
+                   {
+                      const int k = t - c;
+                      b_reg[0][c] = (Iblk+c < N && k >= 0 && k < K) ?
+                         B[k*ldb+Iblk+c] : 0.0f;
+                   }
+                }
+             }
+
+             UNROLL(pe_rows)
+             for (int r = 0; r < pe_rows; r++)
+             {
+                UNROLL(pe_cols)
+                for (int c = 0; c < pe_cols; c++)
+                   acc[r][c] += a_reg[r][c] * b_reg[r][c];
+             }
+          }
+
+          UNROLL(pe_rows)
+          for (int r = 0; r < pe_rows; r++)
+          {
+             UNROLL(pe_cols)
+             for (int c = 0; c < pe_cols; c++)
+             {
+                if (Jblk+r < M && Iblk+c < N)
+                {
+                   __global float* c_elem = C + (Jblk+r)*ldc + Iblk+c;
+                   float result = alpha*acc[r][c];
+                   if (beta != 0.0f)
+                      result += beta*(*c_elem);
+                   *c_elem = result;
+                }
+             }
+          }
+       }
+    }
+}
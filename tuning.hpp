@@ -0,0 +1,126 @@
+#ifndef TUNING_HPP_
+#define TUNING_HPP_
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+
+namespace matrix {
+
+  // Compile-time parameters of a kernel variant, handed to the OpenCL
+  // compiler as -D options.  For mmul, blocksize is the edge of the
+  // work-group and workPerThread the edge of each work-item's micro-tile.
+  // For the matrix-vector products, blocksize is the work-group size (0
+  // lets the runtime pick) and workPerThread the number of work-items
+  // that share each row: 1 runs matrixVectorMul, a power of two that
+  // divides blocksize runs matrixVectorMulRow.
+  struct KernelConfig {
+    int blocksize;
+    int workPerThread;
+    int vectorWidth;
+    int unroll;
+
+    std::string buildOptions() const {
+      std::ostringstream options;
+      options << "-Dblksz=" << blocksize
+              << " -Dwpt=" << workPerThread
+              << " -Dvw=" << vectorWidth
+              << " -Dkunroll=" << unroll;
+      return options.str();
+    }
+  };
+
+  // Shape of the PE array of mmul_systolic, handed to the compiler as
+  // -Dpe_rows and -Dpe_cols.  On an FPGA it is fixed when the image is
+  // built, so it is not tuned at run time.
+  struct SystolicConfig {
+    int rows;
+    int cols;
+
+    std::string buildOptions() const {
+      std::ostringstream options;
+      options << "-Dpe_rows=" << rows << " -Dpe_cols=" << cols;
+      return options.str();
+    }
+  };
+
+  // Problems are tuned per power-of-two bucket of their largest dimension
+  inline unsigned int sizeBucket(const unsigned int size) {
+    unsigned int bucket = 1;
+    while (bucket < size) {
+      bucket <<= 1;
+    }
+    return bucket;
+  }
+
+  inline std::string tuningFile() {
+    const char* path = std::getenv("MATRIXCL_TUNING_FILE");
+    return path ? path : "matrixcl_tuning.txt";
+  }
+
+  // Winning kernel configurations, one per line:
+  //   device <TAB> driver <TAB> kernel <TAB> bucket <TAB> blksz wpt vw unroll
+  class TuningDb {
+  public:
+    explicit TuningDb(const std::string& path): path(path) {
+      std::ifstream stream(path.c_str());
+      std::string line;
+      while (std::getline(stream, line)) {
+        const std::string::size_type tab = line.rfind('\t');
+        if (tab == std::string::npos) {
+          continue;
+        }
+        KernelConfig config;
+        std::istringstream value(line.substr(tab + 1));
+        if (value >> config.blocksize >> config.workPerThread
+                  >> config.vectorWidth >> config.unroll) {
+          entries[line.substr(0, tab)] = config;
+        }
+      }
+    }
+
+    static std::string key(const std::string& device, const std::string& driver,
+                           const std::string& kernel, const unsigned int bucket) {
+      std::ostringstream key;
+      key << device << '\t' << driver << '\t' << kernel << '\t' << bucket;
+      return key.str();
+    }
+
+    bool lookup(const std::string& key, KernelConfig& config) const {
+      auto entry = entries.find(key);
+      if (entry == entries.end()) {
+        return false;
+      }
+      config = entry->second;
+      return true;
+    }
+
+    void store(const std::string& key, const KernelConfig& config) {
+      entries[key] = config;
+    }
+
+    void save() const {
+      std::ofstream stream(path.c_str());
+      if (!stream.is_open()) {
+        std::cerr << "Cannot write tuning file: " << path << std::endl;
+        return;
+      }
+      for (auto& entry : entries) {
+        const KernelConfig& config = entry.second;
+        stream << entry.first << '\t'
+               << config.blocksize << ' ' << config.workPerThread << ' '
+               << config.vectorWidth << ' ' << config.unroll << '\n';
+      }
+    }
+
+  private:
+    std::string path;
+    std::map<std::string, KernelConfig> entries;
+  };
+
+} // namespace matrix
+
+#endif // TUNING_HPP_